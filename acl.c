@@ -0,0 +1,490 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "ip.h"
+#include "acl.h"
+
+/*
+ * Stateless packet filter
+ *
+ * rule format (one rule per line, '#' starts a comment):
+ *   accept|drop [in|out] [proto tcp|udp|icmp|NUM] [src ADDR[/PLEN]] [dst ADDR[/PLEN]] [sport PORT[-PORT]] [dport PORT[-PORT]]
+ *
+ * omitted fields match anything, the first matching rule in the file wins and
+ * datagrams that match no rule are accepted (end the file with "drop" to deny by default).
+ *
+ * the datagrams delivered locally are matched after reassembly. the forwarded ones are not
+ * reassembled, so only the first fragment has the ports: the following fragments of a datagram
+ * whose first fragment was dropped are dropped too (tracked by the IP ID), but the fragments
+ * that arrive before the first one are matched by the rules without sport/dport only.
+ *
+ * NOTE: the rules are compiled into a bitmap-intersection classifier, each field is split
+ *       into elementary intervals that hold the set of the rules matching them. a lookup
+ *       picks one set per field and takes the first rule of their intersection, so the cost
+ *       does not depend on the order of the rules and is bounded by ACL_RULE_MAX.
+ */
+
+#define ACL_LINE_SIZE 256
+
+#define ACL_BITMAP_WORDS (ACL_RULE_MAX / 64)
+
+#define ACL_FIELD_SRC   0
+#define ACL_FIELD_DST   1
+#define ACL_FIELD_SPORT 2
+#define ACL_FIELD_DPORT 3
+#define ACL_FIELD_NUM   4
+
+#define ACL_PORT_MAX 65535
+
+#define ACL_FRAG_TABLE_SIZE 256 /* datagrams whose first fragment was dropped, must be a power of 2 */
+#define ACL_FRAG_TIMEOUT    30 /* seconds, as the reassembly timeout */
+
+struct acl_bitmap {
+    uint64_t bits[ACL_BITMAP_WORDS];
+};
+
+struct acl_rule {
+    uint8_t action;
+    uint8_t dir;
+    int protocol; /* -1: any */
+    int ports; /* sport or dport is specified */
+    uint32_t range[ACL_FIELD_NUM][2]; /* [lo, hi] in host byte order */
+};
+
+struct acl_frag {
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint16_t id;
+    uint8_t protocol;
+    struct timeval timestamp; /* unused if not set */
+};
+
+/* NOTE: maps[i] is the set of the rules matching [bounds[i], bounds[i+1]) */
+struct acl_field {
+    size_t num;
+    uint32_t bounds[ACL_RULE_MAX * 2 + 1];
+    struct acl_bitmap maps[ACL_RULE_MAX * 2 + 1];
+};
+
+/* NOTE: written only by acl_load() before net_run(), read from the input handler and the user threads */
+static struct acl_rule rules[ACL_RULE_MAX];
+static size_t rule_num;
+static struct acl_bitmap dirs[(ACL_DIR_IN | ACL_DIR_OUT) + 1];
+static struct acl_bitmap protos[UINT8_MAX + 1];
+static struct acl_bitmap portless; /* rules for datagrams without ports */
+static struct acl_field fields[ACL_FIELD_NUM];
+static uint16_t port_class[2][ACL_PORT_MAX + 1]; /* port to interval index, no search for ports */
+
+static unsigned long rule_hits[ACL_RULE_MAX];
+
+static mutex_t frag_mutex = MUTEX_INITIALIZER;
+static struct acl_frag frags[ACL_FRAG_TABLE_SIZE]; /* direct-mapped, a newer datagram takes over the slot */
+
+static void
+acl_bitmap_set(struct acl_bitmap *map, size_t idx)
+{
+    map->bits[idx / 64] |= (uint64_t)1 << (idx % 64);
+}
+
+static int
+acl_parse_range(const char *s, uint32_t max, uint32_t range[2])
+{
+    char *ep;
+    unsigned long lo, hi;
+
+    lo = strtoul(s, &ep, 10);
+    if (ep == s || lo > max) {
+        return -1;
+    }
+    hi = lo;
+    if (*ep == '-') {
+        s = ep + 1;
+        hi = strtoul(s, &ep, 10);
+        if (ep == s || hi > max || hi < lo) {
+            return -1;
+        }
+    }
+    if (*ep != '\0') {
+        return -1;
+    }
+    range[0] = lo;
+    range[1] = hi;
+    return 0;
+}
+
+static int
+acl_parse_prefix(char *s, uint32_t range[2])
+{
+    char *p, *ep;
+    long plen = 32;
+    ip_addr_t addr;
+    uint32_t mask;
+
+    p = strchr(s, '/');
+    if (p) {
+        *p++ = '\0';
+        plen = strtol(p, &ep, 10);
+        if (ep == p || *ep != '\0' || plen < 0 || plen > 32) {
+            return -1;
+        }
+    }
+    if (ip_addr_pton(s, &addr) == -1) {
+        return -1;
+    }
+    mask = plen ? ~(uint32_t)0 << (32 - plen) : 0;
+    range[0] = ntoh32(addr) & mask;
+    range[1] = range[0] | ~mask;
+    return 0;
+}
+
+static int
+acl_parse(char *line, struct acl_rule *rule)
+{
+    char *save, *key, *val;
+    uint32_t proto[2];
+    int f;
+
+    key = strtok_r(line, " \t\r\n", &save);
+    if (strcmp(key, "accept") == 0) {
+        rule->action = ACL_ACTION_ACCEPT;
+    } else if (strcmp(key, "drop") == 0) {
+        rule->action = ACL_ACTION_DROP;
+    } else {
+        return -1;
+    }
+    rule->dir = ACL_DIR_IN | ACL_DIR_OUT;
+    rule->protocol = -1;
+    rule->ports = 0;
+    for (f = 0; f < ACL_FIELD_NUM; f++) {
+        rule->range[f][0] = 0;
+        rule->range[f][1] = (f == ACL_FIELD_SPORT || f == ACL_FIELD_DPORT) ? ACL_PORT_MAX : UINT32_MAX;
+    }
+    while ((key = strtok_r(NULL, " \t\r\n", &save))) {
+        if (*key == '#') {
+            break;
+        }
+        if (strcmp(key, "in") == 0) {
+            rule->dir = ACL_DIR_IN;
+            continue;
+        }
+        if (strcmp(key, "out") == 0) {
+            rule->dir = ACL_DIR_OUT;
+            continue;
+        }
+        val = strtok_r(NULL, " \t\r\n", &save);
+        if (!val) {
+            return -1;
+        }
+        if (strcmp(key, "proto") == 0) {
+            if (strcmp(val, "icmp") == 0) {
+                rule->protocol = IP_PROTOCOL_ICMP;
+            } else if (strcmp(val, "tcp") == 0) {
+                rule->protocol = IP_PROTOCOL_TCP;
+            } else if (strcmp(val, "udp") == 0) {
+                rule->protocol = IP_PROTOCOL_UDP;
+            } else {
+                if (acl_parse_range(val, UINT8_MAX, proto) == -1 || proto[0] != proto[1]) {
+                    return -1;
+                }
+                rule->protocol = proto[0];
+            }
+        } else if (strcmp(key, "src") == 0) {
+            if (acl_parse_prefix(val, rule->range[ACL_FIELD_SRC]) == -1) {
+                return -1;
+            }
+        } else if (strcmp(key, "dst") == 0) {
+            if (acl_parse_prefix(val, rule->range[ACL_FIELD_DST]) == -1) {
+                return -1;
+            }
+        } else if (strcmp(key, "sport") == 0) {
+            if (acl_parse_range(val, ACL_PORT_MAX, rule->range[ACL_FIELD_SPORT]) == -1) {
+                return -1;
+            }
+            rule->ports = 1;
+        } else if (strcmp(key, "dport") == 0) {
+            if (acl_parse_range(val, ACL_PORT_MAX, rule->range[ACL_FIELD_DPORT]) == -1) {
+                return -1;
+            }
+            rule->ports = 1;
+        } else {
+            return -1;
+        }
+    }
+    if (rule->ports && rule->protocol != IP_PROTOCOL_TCP && rule->protocol != IP_PROTOCOL_UDP) {
+        /* ports are meaningful only for TCP and UDP */
+        return -1;
+    }
+    return 0;
+}
+
+static int
+acl_bound_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+acl_field_build(struct acl_field *field, int f)
+{
+    size_t num = 0, idx, r;
+
+    field->bounds[num++] = 0;
+    for (r = 0; r < rule_num; r++) {
+        field->bounds[num++] = rules[r].range[f][0];
+        if (rules[r].range[f][1] != UINT32_MAX) {
+            field->bounds[num++] = rules[r].range[f][1] + 1;
+        }
+    }
+    qsort(field->bounds, num, sizeof(field->bounds[0]), acl_bound_cmp);
+    field->num = 1;
+    for (idx = 1; idx < num; idx++) {
+        if (field->bounds[idx] != field->bounds[field->num - 1]) {
+            field->bounds[field->num++] = field->bounds[idx];
+        }
+    }
+    memset(field->maps, 0, sizeof(field->maps));
+    for (idx = 0; idx < field->num; idx++) {
+        for (r = 0; r < rule_num; r++) {
+            if (rules[r].range[f][0] <= field->bounds[idx] && field->bounds[idx] <= rules[r].range[f][1]) {
+                acl_bitmap_set(&field->maps[idx], r);
+            }
+        }
+    }
+}
+
+static const struct acl_bitmap *
+acl_field_lookup(const struct acl_field *field, uint32_t value)
+{
+    size_t lo = 0, hi = field->num, mid;
+
+    /* bounds[0] is always 0, find the last bound that is not greater than the value */
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (field->bounds[mid] <= value) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return &field->maps[lo];
+}
+
+static void
+acl_compile(void)
+{
+    size_t r, idx;
+    uint32_t port;
+    int dir, protocol, i;
+
+    memset(dirs, 0, sizeof(dirs));
+    memset(protos, 0, sizeof(protos));
+    memset(&portless, 0, sizeof(portless));
+    for (r = 0; r < rule_num; r++) {
+        for (dir = ACL_DIR_IN; dir <= ACL_DIR_OUT; dir <<= 1) {
+            if (rules[r].dir & dir) {
+                acl_bitmap_set(&dirs[dir], r);
+            }
+        }
+        for (protocol = 0; protocol <= UINT8_MAX; protocol++) {
+            if (rules[r].protocol == -1 || rules[r].protocol == protocol) {
+                acl_bitmap_set(&protos[protocol], r);
+            }
+        }
+        if (!rules[r].ports) {
+            acl_bitmap_set(&portless, r);
+        }
+    }
+    for (i = 0; i < ACL_FIELD_NUM; i++) {
+        acl_field_build(&fields[i], i);
+    }
+    for (i = 0; i < 2; i++) {
+        idx = 0;
+        for (port = 0; port <= ACL_PORT_MAX; port++) {
+            if (idx + 1 < fields[ACL_FIELD_SPORT + i].num && fields[ACL_FIELD_SPORT + i].bounds[idx + 1] == port) {
+                idx++;
+            }
+            port_class[i][port] = idx;
+        }
+    }
+}
+
+/* NOTE: must not be call after net_run() */
+int
+acl_load(const char *path)
+{
+    FILE *fp;
+    char line[ACL_LINE_SIZE], *p;
+    struct acl_rule table[ACL_RULE_MAX];
+    size_t num = 0, lineno = 0;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        errorf("fopen: %s, path=%s", strerror(errno), path);
+        return -1;
+    }
+    /* parse all lines before replacing the current rules */
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if (!strchr(line, '\n') && !feof(fp)) {
+            errorf("too long line, path=%s, line=%zu", path, lineno);
+            fclose(fp);
+            return -1;
+        }
+        p = line + strspn(line, " \t\r\n");
+        if (!*p || *p == '#') {
+            continue;
+        }
+        if (num == ACL_RULE_MAX) {
+            errorf("too many rules, path=%s, line=%zu", path, lineno);
+            fclose(fp);
+            return -1;
+        }
+        if (acl_parse(p, &table[num]) == -1) {
+            errorf("invalid rule, path=%s, line=%zu", path, lineno);
+            fclose(fp);
+            return -1;
+        }
+        num++;
+    }
+    if (ferror(fp)) {
+        errorf("read error, path=%s, line=%zu", path, lineno);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    memcpy(rules, table, sizeof(*table) * num);
+    rule_num = num;
+    memset(rule_hits, 0, sizeof(rule_hits));
+    acl_compile();
+    infof("loaded %zu rules, path=%s", num, path);
+    return 0;
+}
+
+/* NOTE: data is the payload of the datagram, NULL if it does not start with the transport header */
+int
+acl_filter(int dir, uint8_t protocol, ip_addr_t src, ip_addr_t dst, const uint8_t *data, size_t len)
+{
+    const struct acl_bitmap *maps[5];
+    uint64_t bits;
+    size_t words, w, idx;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+
+    if (!rule_num) {
+        return ACL_ACTION_ACCEPT;
+    }
+    maps[0] = &protos[protocol];
+    maps[1] = acl_field_lookup(&fields[ACL_FIELD_SRC], ntoh32(src));
+    maps[2] = acl_field_lookup(&fields[ACL_FIELD_DST], ntoh32(dst));
+    if ((protocol == IP_PROTOCOL_TCP || protocol == IP_PROTOCOL_UDP) && data && len >= 4) {
+        /* TCP and UDP headers start with the source and destination ports */
+        maps[3] = &fields[ACL_FIELD_SPORT].maps[port_class[0][data[0] << 8 | data[1]]];
+        maps[4] = &fields[ACL_FIELD_DPORT].maps[port_class[1][data[2] << 8 | data[3]]];
+    } else {
+        maps[3] = maps[4] = &portless;
+    }
+    words = (rule_num + 63) / 64;
+    for (w = 0; w < words; w++) {
+        bits = dirs[dir].bits[w] & maps[0]->bits[w] & maps[1]->bits[w] & maps[2]->bits[w] & maps[3]->bits[w] & maps[4]->bits[w];
+        if (bits) {
+            /* the lowest bit is the first rule in the file */
+            idx = w * 64 + __builtin_ctzll(bits);
+            __atomic_add_fetch(&rule_hits[idx], 1, __ATOMIC_RELAXED);
+            if (rules[idx].action == ACL_ACTION_DROP) {
+                debugf("dropped, rule=%zu, %s => %s, protocol=%u",
+                    idx + 1, ip_addr_ntop(src, addr1, sizeof(addr1)), ip_addr_ntop(dst, addr2, sizeof(addr2)), protocol);
+            }
+            return rules[idx].action;
+        }
+    }
+    return ACL_ACTION_ACCEPT;
+}
+
+static struct acl_frag *
+acl_frag_slot(const struct ip_hdr *hdr)
+{
+    uint32_t h;
+
+    h = (ntoh32(hdr->src) ^ ntoh32(hdr->dst) * 0x9e3779b1) ^ (ntoh16(hdr->id) << 8 | hdr->protocol);
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return &frags[h & (ACL_FRAG_TABLE_SIZE - 1)];
+}
+
+static int
+acl_frag_match(const struct acl_frag *frag, const struct ip_hdr *hdr)
+{
+    return frag->src == hdr->src && frag->dst == hdr->dst && frag->id == hdr->id && frag->protocol == hdr->protocol;
+}
+
+/*
+ * NOTE: same as acl_filter() but takes the whole datagram, for the ones that are not reassembled.
+ *       a dropped first fragment is remembered so that the rest of the datagram is dropped as well.
+ */
+int
+acl_filter_datagram(int dir, const uint8_t *data, size_t len)
+{
+    const struct ip_hdr *hdr;
+    uint16_t hlen, offset;
+    struct acl_frag *frag;
+    struct timeval now, diff;
+    int action;
+
+    if (!rule_num) {
+        return ACL_ACTION_ACCEPT;
+    }
+    hdr = (const struct ip_hdr *)data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    offset = ntoh16(hdr->offset);
+    if (!(offset & IP_HDR_OFFSET_MASK)) {
+        action = acl_filter(dir, hdr->protocol, hdr->src, hdr->dst, data + hlen, len - hlen);
+        if (action == ACL_ACTION_DROP && offset & IP_HDR_FLAG_MF) {
+            mutex_lock(&frag_mutex);
+            frag = acl_frag_slot(hdr);
+            frag->src = hdr->src;
+            frag->dst = hdr->dst;
+            frag->id = hdr->id;
+            frag->protocol = hdr->protocol;
+            gettimeofday(&frag->timestamp, NULL);
+            mutex_unlock(&frag_mutex);
+        }
+        return action;
+    }
+    /* non-first fragments do not start with the transport header */
+    mutex_lock(&frag_mutex);
+    frag = acl_frag_slot(hdr);
+    if (timerisset(&frag->timestamp) && acl_frag_match(frag, hdr)) {
+        gettimeofday(&now, NULL);
+        timersub(&now, &frag->timestamp, &diff);
+        if (diff.tv_sec < ACL_FRAG_TIMEOUT) {
+            mutex_unlock(&frag_mutex);
+            debugf("dropped, the first fragment was dropped, id=%u", ntoh16(hdr->id));
+            return ACL_ACTION_DROP;
+        }
+        timerclear(&frag->timestamp);
+    }
+    mutex_unlock(&frag_mutex);
+    return acl_filter(dir, hdr->protocol, hdr->src, hdr->dst, NULL, len - hlen);
+}
+
+/* NOTE: hits[i] is the number of the datagrams matched the i-th rule in the file */
+ssize_t
+acl_stats(unsigned long *hits, size_t size)
+{
+    size_t idx;
+
+    for (idx = 0; idx < size && idx < rule_num; idx++) {
+        hits[idx] = __atomic_load_n(&rule_hits[idx], __ATOMIC_RELAXED);
+    }
+    return rule_num;
+}
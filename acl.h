@@ -0,0 +1,27 @@
+#ifndef ACL_H
+#define ACL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "ip.h"
+
+#define ACL_DIR_IN  0x01 /* received datagrams (delivered locally or forwarded) */
+#define ACL_DIR_OUT 0x02 /* datagrams sent by this host */
+
+#define ACL_ACTION_ACCEPT 0
+#define ACL_ACTION_DROP   1
+
+#define ACL_RULE_MAX 256
+
+extern int
+acl_load(const char *path);
+extern int
+acl_filter(int dir, uint8_t protocol, ip_addr_t src, ip_addr_t dst, const uint8_t *data, size_t len);
+extern int
+acl_filter_datagram(int dir, const uint8_t *data, size_t len);
+extern ssize_t
+acl_stats(unsigned long *hits, size_t size);
+
+#endif
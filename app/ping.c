@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "icmp.h"
+
+#include "driver/loopback.h"
+#include "driver/ether_tap.h"
+
+#include "test/test.h"
+
+#define PING_COUNT_DEFAULT 10
+#define PING_RATE_DEFAULT  1.0 /* per second */
+#define PING_SIZE_DEFAULT  56
+#define PING_SIZE_MAX      (IP_PAYLOAD_SIZE_MAX - ICMP_HDR_SIZE)
+#define PING_WAIT_DEFAULT  1 /* seconds to wait for the replies after the last request */
+
+#define PING_PRELOAD_DEFAULT 1 /* requests outstanding at a time in the flood mode */
+#define PING_FLOOD_TIMEOUT 10000000 /* nanoseconds, sends the next one anyway if no reply (as ping -f) */
+#define PING_FLOOD_POLL    10000 /* nanoseconds */
+#define PING_FLOOD_BACKOFF 100000 /* nanoseconds, when the request is not sent */
+
+/*
+ * HDR-style histogram: the values below 2 * HIST_SUB_COUNT are counted exactly, larger values
+ * fall into HIST_SUB_COUNT sub-buckets per power of 2 (about 3% relative error).
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB_COUNT * 2 + (63 - HIST_SUB_BITS) * HIST_SUB_COUNT)
+
+struct hist {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+};
+
+static volatile sig_atomic_t terminate;
+
+static uint16_t id;
+static int flood;
+static uint64_t sent_at[UINT16_MAX + 1]; /* nanoseconds, 0 if no request is outstanding for the seq */
+static unsigned long nsent, nrecv, ndup;
+static struct hist hist; /* NOTE: updated only in the input context */
+
+static void
+on_signal(int s)
+{
+    (void)s;
+    terminate = 1;
+    net_interrupt();
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+hist_index(uint64_t value)
+{
+    int shift;
+
+    if (value < HIST_SUB_COUNT * 2) {
+        return value;
+    }
+    shift = (63 - __builtin_clzll(value)) - HIST_SUB_BITS;
+    return HIST_SUB_COUNT * 2 + (shift - 1) * HIST_SUB_COUNT + ((value >> shift) - HIST_SUB_COUNT);
+}
+
+/* NOTE: returns the largest value counted in the bucket */
+static uint64_t
+hist_value(size_t index)
+{
+    int shift;
+
+    if (index < HIST_SUB_COUNT * 2) {
+        return index;
+    }
+    index -= HIST_SUB_COUNT * 2;
+    shift = index / HIST_SUB_COUNT + 1;
+    return (((uint64_t)(index % HIST_SUB_COUNT + HIST_SUB_COUNT + 1)) << shift) - 1;
+}
+
+static void
+hist_record(struct hist *h, uint64_t value)
+{
+    h->counts[hist_index(value)]++;
+    if (!h->total || value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+    h->sum += value;
+    h->total++;
+}
+
+static uint64_t
+hist_percentile(struct hist *h, double p)
+{
+    unsigned long rank, acc = 0;
+    size_t index;
+
+    rank = (unsigned long)(h->total * p / 100.0 + 0.5);
+    if (!rank) {
+        rank = 1;
+    }
+    for (index = 0; index < HIST_BUCKETS; index++) {
+        acc += h->counts[index];
+        if (acc >= rank) {
+            return MIN(hist_value(index), h->max);
+        }
+    }
+    return h->max;
+}
+
+static void
+echo_reply_handler(uint16_t seq, const uint8_t *data, size_t len, ip_addr_t src, void *arg)
+{
+    uint64_t sent, rtt;
+    char addr[IP_ADDR_STR_LEN];
+
+    sent = __atomic_exchange_n(&sent_at[seq], 0, __ATOMIC_RELAXED);
+    if (!sent) {
+        __atomic_add_fetch(&ndup, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rtt = now_ns() - sent;
+    hist_record(&hist, rtt);
+    __atomic_add_fetch(&nrecv, 1, __ATOMIC_RELAXED);
+    if (!flood) {
+        printf("%zu bytes from %s: icmp_seq=%u time=%.3f ms\n",
+            len, ip_addr_ntop(src, addr, sizeof(addr)), seq, rtt / 1000000.0);
+    }
+}
+
+static int
+setup(void)
+{
+    struct net_device *dev;
+    struct ip_iface *iface;
+
+    signal(SIGINT, on_signal);
+    if (net_init() == -1) {
+        errorf("net_init() failure");
+        return -1;
+    }
+    dev = loopback_init();
+    if (!dev) {
+        errorf("loopback_init() failure");
+        return -1;
+    }
+    iface = ip_iface_alloc(LOOPBACK_IP_ADDR, LOOPBACK_NETMASK);
+    if (!iface) {
+        errorf("ip_iface_alloc() failure");
+        return -1;
+    }
+    if (ip_iface_register(dev, iface) == -1) {
+        errorf("ip_iface_register() failure");
+        return -1;
+    }
+    dev = ether_tap_init(ETHER_TAP_NAME, ETHER_TAP_HW_ADDR);
+    if (!dev) {
+        errorf("ether_tap_init() failure");
+        return -1;
+    }
+    iface = ip_iface_alloc(ETHER_TAP_IP_ADDR, ETHER_TAP_NETMASK);
+    if (!iface) {
+        errorf("ip_iface_alloc() failure");
+        return -1;
+    }
+    if (ip_iface_register(dev, iface) == -1) {
+        errorf("ip_iface_register() failure");
+        return -1;
+    }
+    if (ip_route_set_default_gateway(iface, DEFAULT_GATEWAY) == -1) {
+        errorf("ip_route_set_default_gateway() failure");
+        return -1;
+    }
+    if (icmp_echo_reply_register(id, echo_reply_handler, NULL) == -1) {
+        errorf("icmp_echo_reply_register() failure");
+        return -1;
+    }
+    if (net_run() == -1) {
+        errorf("net_run() failure");
+        return -1;
+    }
+    return 0;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-c count] [-r rate | -f [-l preload]] [-s size] [-w wait] addr\n", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    long int count = PING_COUNT_DEFAULT, size = PING_SIZE_DEFAULT, wait = PING_WAIT_DEFAULT, preload = PING_PRELOAD_DEFAULT;
+    double rate = PING_RATE_DEFAULT;
+    ip_addr_t dst;
+    uint8_t data[PING_SIZE_MAX];
+    uint16_t seq;
+    uint64_t interval, start, elapsed, deadline, last = 0;
+    struct timespec next, poll = {0, PING_FLOOD_POLL}, backoff = {0, PING_FLOOD_BACKOFF};
+    unsigned long nerr = 0, received;
+    long int i;
+    char addr[IP_ADDR_STR_LEN];
+
+    /*
+     * Parse command line parameters
+     */
+    while ((opt = getopt(argc, argv, "c:r:fl:s:w:")) != -1) {
+        switch (opt) {
+        case 'c':
+            count = strtol(optarg, NULL, 10);
+            if (count < 0) {
+                errorf("invalid count, count=%s", optarg);
+                return -1;
+            }
+            break;
+        case 'r':
+            rate = strtod(optarg, NULL);
+            if (rate <= 0) {
+                errorf("invalid rate, rate=%s", optarg);
+                return -1;
+            }
+            break;
+        case 'f':
+            flood = 1;
+            break;
+        case 'l':
+            preload = strtol(optarg, NULL, 10);
+            if (preload < 1 || preload > UINT16_MAX) {
+                errorf("invalid preload, preload=%s", optarg);
+                return -1;
+            }
+            break;
+        case 's':
+            size = strtol(optarg, NULL, 10);
+            if (size < 0 || size > PING_SIZE_MAX) {
+                errorf("invalid size, size=%s", optarg);
+                return -1;
+            }
+            break;
+        case 'w':
+            wait = strtol(optarg, NULL, 10);
+            if (wait < 0) {
+                errorf("invalid wait, wait=%s", optarg);
+                return -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (ip_addr_pton(argv[optind], &dst) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", argv[optind]);
+        return -1;
+    }
+    for (i = 0; i < size; i++) {
+        data[i] = i & 0xff;
+    }
+    id = getpid() & 0xffff;
+    /*
+     * Setup protocol stack
+     */
+    if (setup() == -1) {
+        errorf("setup() failure");
+        return -1;
+    }
+    /*
+     * Application Code
+     */
+    interval = (uint64_t)(1000000000 / rate);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    start = now_ns();
+    while (!terminate && (!count || (long int)nsent < count)) {
+        if (flood) {
+            while (!terminate && nsent - __atomic_load_n(&nrecv, __ATOMIC_RELAXED) >= (unsigned long)preload && now_ns() - last < PING_FLOOD_TIMEOUT) {
+                nanosleep(&poll, NULL);
+            }
+            last = now_ns();
+        } else {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+            next.tv_nsec += interval % 1000000000;
+            next.tv_sec += interval / 1000000000 + next.tv_nsec / 1000000000;
+            next.tv_nsec %= 1000000000;
+        }
+        seq = nsent & 0xffff;
+        __atomic_store_n(&sent_at[seq], now_ns(), __ATOMIC_RELAXED);
+        if (icmp_output(ICMP_TYPE_ECHO, 0, hton32((uint32_t)id << 16 | seq), data, size, IP_ADDR_ANY, dst) == -1) {
+            __atomic_store_n(&sent_at[seq], 0, __ATOMIC_RELAXED);
+            nerr++;
+            if (flood) {
+                /* the device queue may be full, give it a moment and retry the same seq */
+                nanosleep(&backoff, NULL);
+                continue;
+            }
+        }
+        nsent++;
+    }
+    elapsed = now_ns() - start;
+    deadline = now_ns() + (uint64_t)wait * 1000000000;
+    while (!terminate && __atomic_load_n(&nrecv, __ATOMIC_RELAXED) < nsent && now_ns() < deadline) {
+        usleep(1000);
+    }
+    /*
+     * Cleanup protocol stack
+     */
+    net_shutdown();
+    /*
+     * Report
+     */
+    received = nrecv;
+    printf("--- %s ping statistics ---\n", ip_addr_ntop(dst, addr, sizeof(addr)));
+    printf("%lu packets transmitted, %lu received, %lu duplicates, %lu errors, %.3f%% packet loss, time %.3f ms\n",
+        nsent, received, ndup, nerr, nsent ? (nsent - received) * 100.0 / nsent : 0.0, elapsed / 1000000.0);
+    if (hist.total) {
+        printf("rtt min/avg/max = %.3f/%.3f/%.3f us\n",
+            hist.min / 1000.0, hist.sum / 1000.0 / hist.total, hist.max / 1000.0);
+        printf("rtt p50/p90/p99/p999 = %.3f/%.3f/%.3f/%.3f us\n",
+            hist_percentile(&hist, 50.0) / 1000.0, hist_percentile(&hist, 90.0) / 1000.0,
+            hist_percentile(&hist, 99.0) / 1000.0, hist_percentile(&hist, 99.9) / 1000.0);
+    }
+    return 0;
+}
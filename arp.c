@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/time.h>
 
 #include "platform.h"
@@ -26,6 +27,10 @@
 #define ARP_CACHE_STATE_INCOMPLETE 1
 #define ARP_CACHE_STATE_RESOLVED   2
 #define ARP_CACHE_STATE_STATIC     3
+#define ARP_CACHE_STATE_STALE      4 /* restored from the snapshot file, not yet revalidated */
+
+#define ARP_CACHE_FILE_MAGIC   "ARPC"
+#define ARP_CACHE_FILE_VERSION 1
 
 struct arp_hdr {
     uint16_t hrd;
@@ -50,8 +55,20 @@ struct arp_cache {
     struct timeval timestamp;
 };
 
+/* NOTE: on-disk layout of the snapshot file, a header followed by records */
+struct arp_cache_file_hdr {
+    char magic[4];
+    uint8_t version;
+};
+
+struct arp_cache_file_entry {
+    uint8_t pa[IP_ADDR_LEN];
+    uint8_t ha[ETHER_ADDR_LEN];
+};
+
 static mutex_t mutex = MUTEX_INITIALIZER;
 static struct arp_cache caches[ARP_CACHE_SIZE];
+static char cache_file[256]; /* snapshot file, empty if disabled */
 
 static char *
 arp_opcode_ntoa(uint16_t opcode)
@@ -110,6 +127,8 @@ arp_cache_alloc(void)
             oldest = entry;
         }
     }
+    /* the evicted entry may be cached in the destination caches */
+    ip_dst_cache_invalidate();
     return oldest;
 }
 
@@ -138,6 +157,10 @@ arp_cache_update(ip_addr_t pa, const uint8_t *ha)
         /* not found */
         return NULL;
     }
+    if (memcmp(cache->ha, ha, ETHER_ADDR_LEN) != 0) {
+        /* the hardware address may be cached in the destination caches */
+        ip_dst_cache_invalidate();
+    }
     cache->state = ARP_CACHE_STATE_RESOLVED;
     memcpy(cache->ha, ha, ETHER_ADDR_LEN);
     gettimeofday(&cache->timestamp, NULL);
@@ -172,6 +195,7 @@ arp_cache_delete(struct arp_cache *cache)
     char addr2[ETHER_ADDR_STR_LEN];
 
     debugf("DELETE: pa=%s, ha=%s", ip_addr_ntop(cache->pa, addr1, sizeof(addr1)), ether_addr_ntop(cache->ha, addr2, sizeof(addr2)));
+    ip_dst_cache_invalidate();
     cache->state = ARP_CACHE_STATE_FREE;
     cache->pa = 0;
     memset(cache->ha, 0, ETHER_ADDR_LEN);
@@ -247,8 +271,8 @@ arp_input(const uint8_t *data, size_t len, struct net_device *dev)
         merge = 1;
     }
     mutex_unlock(&mutex);
-    iface = net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
-    if (iface && ((struct ip_iface *)iface)->unicast == tpa) {
+    iface = NET_IFACE(ip_iface_select(tpa));
+    if (iface && iface->dev == dev) {
         if (!merge) {
             mutex_lock(&mutex);
             arp_cache_insert(spa, msg->sha);
@@ -297,6 +321,14 @@ arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
         mutex_unlock(&mutex);
         return ARP_RESOLVE_INCOMPLETE;
     }
+    if (cache->state == ARP_CACHE_STATE_STALE) {
+        /*
+         * Use the restored address as is and ask once for a fresh one.
+         * The timestamp is left untouched, so the entry expires as usual unless a reply updates it.
+         */
+        arp_request(iface, pa);
+        cache->state = ARP_CACHE_STATE_RESOLVED;
+    }
     memcpy(ha, cache->ha, ETHER_ADDR_LEN);
     mutex_unlock(&mutex);
     debugf("resolved, pa=%s, ha=%s",
@@ -323,6 +355,135 @@ arp_timer(void)
     mutex_unlock(&mutex);
 }
 
+/*
+ * ARP Cache Snapshot
+ */
+
+static int
+arp_cache_load(const char *path)
+{
+    FILE *fp;
+    struct arp_cache_file_hdr hdr;
+    struct arp_cache_file_entry record;
+    struct arp_cache *cache;
+    struct timeval now;
+    ip_addr_t pa;
+    int num = 0;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        if (errno == ENOENT) {
+            debugf("snapshot not found, path=%s", path);
+            return 0;
+        }
+        errorf("fopen: %s, path=%s", strerror(errno), path);
+        return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, ARP_CACHE_FILE_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != ARP_CACHE_FILE_VERSION) {
+        warnf("invalid snapshot, ignored, path=%s", path);
+        fclose(fp);
+        return 0;
+    }
+    gettimeofday(&now, NULL);
+    mutex_lock(&mutex);
+    while (fread(&record, sizeof(record), 1, fp) == 1) {
+        memcpy(&pa, record.pa, IP_ADDR_LEN);
+        if (arp_cache_select(pa)) {
+            continue;
+        }
+        cache = arp_cache_alloc();
+        if (!cache || cache->state != ARP_CACHE_STATE_FREE) {
+            /* never evict an entry for a restored one */
+            break;
+        }
+        cache->state = ARP_CACHE_STATE_STALE;
+        cache->pa = pa;
+        memcpy(cache->ha, record.ha, ETHER_ADDR_LEN);
+        cache->timestamp = now;
+        num++;
+    }
+    mutex_unlock(&mutex);
+    if (ferror(fp)) {
+        /* keep the entries restored so far, they are only a hint and get revalidated */
+        warnf("fread: %s, path=%s", strerror(errno), path);
+    }
+    fclose(fp);
+    infof("restored %d entries, path=%s", num, path);
+    return 0;
+}
+
+static int
+arp_cache_save(const char *path)
+{
+    char tmp[sizeof(cache_file) + 4];
+    FILE *fp;
+    struct arp_cache_file_hdr hdr;
+    struct arp_cache_file_entry record;
+    struct arp_cache *entry;
+    int num = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (!fp) {
+        errorf("fopen: %s, path=%s", strerror(errno), tmp);
+        return -1;
+    }
+    memcpy(hdr.magic, ARP_CACHE_FILE_MAGIC, sizeof(hdr.magic));
+    hdr.version = ARP_CACHE_FILE_VERSION;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        errorf("fwrite: %s, path=%s", strerror(errno), tmp);
+        fclose(fp);
+        remove(tmp);
+        return -1;
+    }
+    mutex_lock(&mutex);
+    for (entry = caches; entry < tailof(caches); entry++) {
+        switch (entry->state) {
+        case ARP_CACHE_STATE_RESOLVED:
+        case ARP_CACHE_STATE_STATIC:
+        case ARP_CACHE_STATE_STALE:
+            memcpy(record.pa, &entry->pa, IP_ADDR_LEN);
+            memcpy(record.ha, entry->ha, ETHER_ADDR_LEN);
+            if (fwrite(&record, sizeof(record), 1, fp) != 1) {
+                mutex_unlock(&mutex);
+                errorf("fwrite: %s, path=%s", strerror(errno), tmp);
+                fclose(fp);
+                remove(tmp);
+                return -1;
+            }
+            num++;
+            break;
+        }
+    }
+    mutex_unlock(&mutex);
+    if (fclose(fp) == EOF) {
+        errorf("fclose: %s, path=%s", strerror(errno), tmp);
+        remove(tmp);
+        return -1;
+    }
+    /* replace atomically, a crash while writing never leaves a truncated snapshot */
+    if (rename(tmp, path) == -1) {
+        errorf("rename: %s, path=%s", strerror(errno), path);
+        remove(tmp);
+        return -1;
+    }
+    infof("saved %d entries, path=%s", num, path);
+    return 0;
+}
+
+/* NOTE: must be called before net_init() */
+int
+arp_cache_file(const char *path)
+{
+    if (strlen(path) >= sizeof(cache_file)) {
+        errorf("too long, path=%s", path);
+        return -1;
+    }
+    strcpy(cache_file, path);
+    return 0;
+}
+
 int
 arp_init(void)
 {
@@ -336,5 +497,19 @@ arp_init(void)
         errorf("net_timer_register() failure");
         return -1;
     }
+    if (cache_file[0]) {
+        if (arp_cache_load(cache_file) == -1) {
+            errorf("arp_cache_load() failure");
+            return -1;
+        }
+    }
     return 0;
 }
+
+void
+arp_shutdown(void)
+{
+    if (cache_file[0]) {
+        arp_cache_save(cache_file);
+    }
+}
@@ -12,7 +12,12 @@
 
 extern int
 arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha);
+extern int
+arp_cache_file(const char *path);
+
 extern int
 arp_init(void);
+extern void
+arp_shutdown(void);
 
 #endif
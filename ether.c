@@ -82,10 +82,9 @@ ether_dump(const uint8_t *frame, size_t flen)
     funlockfile(stderr);
 }
 
-int
-ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *data, size_t len))
+static size_t
+ether_frame_build(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, uint8_t *frame)
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX] = {};
     struct ether_hdr *hdr;
     size_t flen, pad = 0;
 
@@ -96,13 +95,54 @@ ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data
     memcpy(hdr + 1, data, len);
     if (len < ETHER_PAYLOAD_SIZE_MIN) {
         pad = ETHER_PAYLOAD_SIZE_MIN - len;
+        memset((uint8_t *)(hdr + 1) + len, 0, pad);
     }
     flen = sizeof(*hdr) + len + pad;
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
     ether_dump(frame, flen);
+    return flen;
+}
+
+int
+ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *data, size_t len))
+{
+    uint8_t frame[ETHER_FRAME_SIZE_MAX];
+    size_t flen;
+
+    flen = ether_frame_build(dev, type, data, len, dst, frame);
     return callback(dev, frame, flen) == (ssize_t)flen ? 0 : -1;
 }
 
+/*
+ * NOTE: the callback writes the built frames at once (each iovec is a whole frame)
+ *       and returns the number of the frames written, or -1 if none of them.
+ */
+int
+ether_transmit_batch_helper(struct net_device *dev, const struct net_device_frame *frames, size_t num, int (*callback)(struct net_device *dev, const struct iovec *frames, size_t num))
+{
+    uint8_t buf[ETHER_TRANSMIT_BATCH_MAX][ETHER_FRAME_SIZE_MAX];
+    struct iovec iov[ETHER_TRANSMIT_BATCH_MAX];
+    size_t done = 0, n, i;
+    int ret;
+
+    while (done < num) {
+        n = MIN(num - done, ETHER_TRANSMIT_BATCH_MAX);
+        for (i = 0; i < n; i++) {
+            iov[i].iov_base = buf[i];
+            iov[i].iov_len = ether_frame_build(dev, frames[done+i].type, frames[done+i].data, frames[done+i].len, frames[done+i].dst, buf[i]);
+        }
+        ret = callback(dev, iov, n);
+        if (ret == -1) {
+            return done ? (int)done : -1;
+        }
+        done += ret;
+        if ((size_t)ret < n) {
+            break;
+        }
+    }
+    return done;
+}
+
 int
 ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size))
 {
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "net.h"
 
@@ -17,6 +18,8 @@
 #define ETHER_PAYLOAD_SIZE_MIN (ETHER_FRAME_SIZE_MIN - ETHER_HDR_SIZE)
 #define ETHER_PAYLOAD_SIZE_MAX (ETHER_FRAME_SIZE_MAX - ETHER_HDR_SIZE)
 
+#define ETHER_TRANSMIT_BATCH_MAX 32 /* frames built at once by ether_transmit_batch_helper() */
+
 /* see https://www.iana.org/assignments/ieee-802-numbers/ieee-802-numbers.txt */
 #define ETHER_TYPE_IP   0x0800
 #define ETHER_TYPE_ARP  0x0806
@@ -33,6 +36,8 @@ ether_addr_ntop(const uint8_t *n, char *p, size_t size);
 extern int
 ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *buf, size_t len));
 extern int
+ether_transmit_batch_helper(struct net_device *dev, const struct net_device_frame *frames, size_t num, int (*callback)(struct net_device *dev, const struct iovec *frames, size_t num));
+extern int
 ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size));
 extern void
 ether_setup_helper(struct net_device *net_device);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "util.h"
 #include "ip.h"
@@ -8,6 +9,21 @@
 
 #define ICMP_BUFSIZ IP_PAYLOAD_SIZE_MAX
 
+/* an error message must not exceed 576 bytes (RFC 1812 4.3.2.3) */
+#define ICMP_ERROR_QUOTE_MAX (576 - IP_HDR_SIZE_MIN - ICMP_HDR_SIZE)
+
+/* rate limits of the error messages (RFC 1812 4.3.2.8), messages per second and burst size */
+#define ICMP_ERROR_RATE_GLOBAL   1000
+#define ICMP_ERROR_BURST_GLOBAL  50
+#define ICMP_ERROR_RATE_PER_DST  1
+#define ICMP_ERROR_BURST_PER_DST 6
+
+#define ICMP_ERROR_BUCKET_SIZE 256 /* per-destination buckets, must be a power of 2 */
+
+#define ICMP_TOKEN_UNIT 1000 /* tokens are counted in 1/1000 of a message */
+
+#define ICMP_ECHO_HANDLER_MAX 8
+
 struct icmp_hdr {
     uint8_t type;
     uint8_t code;
@@ -23,6 +39,26 @@ struct icmp_echo {
     uint16_t seq;
 };
 
+struct icmp_bucket {
+    ip_addr_t dst; /* owner of the per-destination bucket, IP_ADDR_ANY if unused */
+    uint32_t tokens;
+    struct timeval timestamp;
+};
+
+struct icmp_echo_handler {
+    int used;
+    uint16_t id; /* host byte order */
+    void (*handler)(uint16_t seq, const uint8_t *data, size_t len, ip_addr_t src, void *arg);
+    void *arg;
+};
+
+/* NOTE: if you want to add/delete the entries after net_run(), you need to protect these handlers with a mutex. */
+static struct icmp_echo_handler echo_handlers[ICMP_ECHO_HANDLER_MAX];
+
+/* NOTE: accessed only from the input and timer handlers */
+static struct icmp_bucket global_bucket;
+static struct icmp_bucket dst_buckets[ICMP_ERROR_BUCKET_SIZE];
+
 static char *
 icmp_type_ntoa(uint8_t type) {
     switch (type) {
@@ -80,22 +116,25 @@ icmp_dump(const uint8_t *data, size_t len)
     funlockfile(stderr);
 }
 
-static void
+static int
 icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
     struct icmp_hdr *hdr;
+    struct icmp_echo *echo;
+    struct icmp_echo_handler *entry;
+    struct ip_hdr *orig;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     char addr3[IP_ADDR_STR_LEN];
 
     if (len < sizeof(*hdr)) {
         errorf("too short");
-        return;
+        return -1;
     }
     hdr = (struct icmp_hdr *)data;
     if (cksum16((uint16_t *)data, len, 0) != 0) {
         errorf("checksum error, sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)data, len, -hdr->sum)));
-        return;
+        return -1;
     }
     debugf("%s => %s, type=%s(%u), len=%zu, iface=%s",
         ip_addr_ntop(src, addr1, sizeof(addr1)),
@@ -112,10 +151,37 @@ icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         }
         icmp_output(ICMP_TYPE_ECHOREPLY, hdr->code, hdr->values, (uint8_t *)(hdr + 1), len - sizeof(*hdr), dst, src);
         break;
+    case ICMP_TYPE_ECHOREPLY:
+        echo = (struct icmp_echo *)hdr;
+        for (entry = echo_handlers; entry < tailof(echo_handlers); entry++) {
+            if (entry->used && entry->id == ntoh16(echo->id)) {
+                entry->handler(ntoh16(echo->seq), (uint8_t *)(echo + 1), len - sizeof(*echo), src, entry->arg);
+                break;
+            }
+        }
+        break;
+    case ICMP_TYPE_DEST_UNREACH:
+        if (hdr->code != ICMP_CODE_FRAGMENT_NEEDED) {
+            break;
+        }
+        /* the message carries the header of the original datagram that we sent */
+        if (len < sizeof(*hdr) + IP_HDR_SIZE_MIN) {
+            errorf("too short original datagram");
+            break;
+        }
+        orig = (struct ip_hdr *)(hdr + 1);
+        if (!ip_iface_select(orig->src)) {
+            /* not sent by us */
+            break;
+        }
+        /* Next-Hop MTU is in the low-order 16 bits (RFC 1191) */
+        ip_pmtu_update(orig->dst, ntoh32(hdr->values) & 0xffff, ntoh16(orig->total));
+        break;
     default:
         /* ignore */
         break;
     }
+    return 0;
 }
 
 int
@@ -143,6 +209,172 @@ icmp_output(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, si
     return ip_output(IP_PROTOCOL_ICMP, (uint8_t *)hdr, msg_len, src, dst);
 }
 
+static int
+icmp_is_query(uint8_t type)
+{
+    switch (type) {
+    case ICMP_TYPE_ECHOREPLY:
+    case ICMP_TYPE_ECHO:
+    case ICMP_TYPE_TIMESTAMP:
+    case ICMP_TYPE_TIMESTAMPREPLY:
+    case ICMP_TYPE_INFO_REQUEST:
+    case ICMP_TYPE_INFO_REPLY:
+        return 1;
+    }
+    return 0;
+}
+
+static int
+icmp_addr_is_multicast(ip_addr_t addr)
+{
+    return (ntoh32(addr) & 0xf0000000) == 0xe0000000; /* 224.0.0.0/4 */
+}
+
+/* NOTE: a directed broadcast of another attached subnet (e.g. on the forwarding path) is routed to its iface */
+static int
+icmp_addr_is_broadcast(ip_addr_t addr, struct ip_iface *iface)
+{
+    struct ip_iface *route_iface;
+
+    if (addr == IP_ADDR_BROADCAST || addr == iface->broadcast) {
+        return 1;
+    }
+    route_iface = ip_route_get_iface(addr);
+    return route_iface && addr == route_iface->broadcast;
+}
+
+/*
+ * NOTE: the bucket is refilled with the time elapsed since the last call, up to the burst size.
+ *       the elapsed time is capped at the time to fill an empty bucket before it is multiplied,
+ *       and a bucket that has never been used starts full.
+ */
+static int
+icmp_bucket_consume(struct icmp_bucket *bucket, uint32_t rate, uint32_t burst, const struct timeval *now)
+{
+    struct timeval diff;
+    uint64_t elapsed, tokens;
+
+    if (!timerisset(&bucket->timestamp)) {
+        bucket->tokens = burst * ICMP_TOKEN_UNIT;
+        bucket->timestamp = *now;
+    }
+    timersub(now, &bucket->timestamp, &diff);
+    if (diff.tv_sec < 0) {
+        /* the clock went backwards */
+        elapsed = 0;
+    } else {
+        elapsed = MIN((uint64_t)diff.tv_sec * 1000000 + diff.tv_usec, (uint64_t)burst * 1000000 / rate + 1);
+    }
+    tokens = bucket->tokens + elapsed * rate * ICMP_TOKEN_UNIT / 1000000;
+    bucket->tokens = MIN(tokens, (uint64_t)burst * ICMP_TOKEN_UNIT);
+    bucket->timestamp = *now;
+    if (bucket->tokens < ICMP_TOKEN_UNIT) {
+        return -1;
+    }
+    bucket->tokens -= ICMP_TOKEN_UNIT;
+    return 0;
+}
+
+static int
+icmp_error_allowed(ip_addr_t dst)
+{
+    struct timeval now;
+    struct icmp_bucket *bucket;
+
+    gettimeofday(&now, NULL);
+    bucket = &dst_buckets[ntoh32(dst) * 2654435761u >> 24 & (ICMP_ERROR_BUCKET_SIZE - 1)];
+    if (bucket->dst != dst) {
+        /* the slot is taken over by the new destination with a full bucket */
+        bucket->dst = dst;
+        bucket->tokens = ICMP_ERROR_BURST_PER_DST * ICMP_TOKEN_UNIT;
+        bucket->timestamp = now;
+    }
+    if (icmp_bucket_consume(bucket, ICMP_ERROR_RATE_PER_DST, ICMP_ERROR_BURST_PER_DST, &now) == -1) {
+        return 0;
+    }
+    if (icmp_bucket_consume(&global_bucket, ICMP_ERROR_RATE_GLOBAL, ICMP_ERROR_BURST_GLOBAL, &now) == -1) {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * NOTE: datagram is the offending one as received on iface, starting with its IP header.
+ *       no message is sent for the datagrams listed in RFC 1812 4.3.2.7 or when the rate
+ *       limit is exceeded, it is not an error for the caller.
+ */
+int
+icmp_error(uint8_t type, uint8_t code, uint32_t values, const uint8_t *datagram, size_t len, struct ip_iface *iface)
+{
+    struct ip_hdr *hdr;
+    uint16_t hlen;
+    ip_addr_t src;
+    char addr[IP_ADDR_STR_LEN];
+
+    if (len < IP_HDR_SIZE_MIN) {
+        errorf("too short");
+        return -1;
+    }
+    hdr = (struct ip_hdr *)datagram;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    if (len < hlen) {
+        errorf("too short");
+        return -1;
+    }
+    if (hdr->protocol == IP_PROTOCOL_ICMP && (len == hlen || !icmp_is_query(datagram[hlen]))) {
+        /* never respond to an error message */
+        return 0;
+    }
+    if (ntoh16(hdr->offset) & IP_HDR_OFFSET_MASK) {
+        /* only the first fragment is reported */
+        return 0;
+    }
+    if (icmp_addr_is_broadcast(hdr->dst, iface) || icmp_addr_is_multicast(hdr->dst)) {
+        return 0;
+    }
+    if (hdr->src == IP_ADDR_ANY || icmp_addr_is_broadcast(hdr->src, iface) || icmp_addr_is_multicast(hdr->src)) {
+        /* does not identify a single host */
+        return 0;
+    }
+    if (!icmp_error_allowed(hdr->src)) {
+        debugf("rate limited, type=%s(%u), dst=%s", icmp_type_ntoa(type), type, ip_addr_ntop(hdr->src, addr, sizeof(addr)));
+        return 0;
+    }
+    /* reply from the address the datagram was sent to if it is ours (e.g. port unreachable) */
+    src = ip_iface_select(hdr->dst) ? hdr->dst : iface->unicast;
+    return icmp_output(type, code, values, datagram, MIN(len, ICMP_ERROR_QUOTE_MAX), src, hdr->src);
+}
+
+/*
+ * NOTE: the handler is called in the input context for each echo reply that carries the id,
+ *       it must not block.
+ * NOTE: must not be call after net_run()
+ */
+int
+icmp_echo_reply_register(uint16_t id, void (*handler)(uint16_t seq, const uint8_t *data, size_t len, ip_addr_t src, void *arg), void *arg)
+{
+    struct icmp_echo_handler *entry;
+
+    for (entry = echo_handlers; entry < tailof(echo_handlers); entry++) {
+        if (entry->used && entry->id == id) {
+            errorf("already registered, id=%u", id);
+            return -1;
+        }
+    }
+    for (entry = echo_handlers; entry < tailof(echo_handlers); entry++) {
+        if (!entry->used) {
+            entry->used = 1;
+            entry->id = id;
+            entry->handler = handler;
+            entry->arg = arg;
+            debugf("registered, id=%u", id);
+            return 0;
+        }
+    }
+    errorf("no space left");
+    return -1;
+}
+
 int
 icmp_init(void)
 {
@@ -41,6 +41,10 @@
 extern int
 icmp_output(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
 extern int
+icmp_error(uint8_t type, uint8_t code, uint32_t values, const uint8_t *datagram, size_t len, struct ip_iface *iface);
+extern int
+icmp_echo_reply_register(uint16_t id, void (*handler)(uint16_t seq, const uint8_t *data, size_t len, ip_addr_t src, void *arg), void *arg);
+extern int
 icmp_init(void);
 
 #endif
@@ -2,6 +2,12 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "platform.h"
 
@@ -9,12 +15,29 @@
 #include "net.h"
 #include "arp.h"
 #include "ip.h"
+#include "icmp.h"
+#include "acl.h"
+
+#define IP_REASS_TIMEOUT 30 /* seconds */
+#define IP_REASS_MEMORY_MAX (1024 * 1024) /* bytes, total of all reassembly buffers */
+#define IP_REASS_BUFSIZ_MIN 4096
+
+#define IP_IFACE_HASH_SIZE 1024 /* buckets of the local address hash, must be a power of 2 */
+
+#define IP_ROUTE_WEIGHT_DEFAULT 1
+#define IP_ROUTE_WEIGHT_MAX 255
+
+#define IP_FORWARD_TTL_MIN 1
+
+#define IP_PMTU_CACHE_SIZE 64
+#define IP_PMTU_TIMEOUT 600 /* seconds, see RFC 1191 section 6.3 */
+#define IP_PMTU_MIN 68 /* minimum MTU of the internet, see RFC 791 */
 
 struct ip_protocol {
     struct ip_protocol *next;
     char name[16];
     uint8_t type;
-    void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface);
+    int (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface);
 };
 
 struct ip_route {
@@ -23,20 +46,53 @@ struct ip_route {
     ip_addr_t netmask;
     ip_addr_t nexthop;
     struct ip_iface *iface;
+    uint8_t plen; /* prefix length of the netmask */
+    uint8_t weight; /* share of the flows among the paths of the same prefix */
+    struct ip_route *sibling; /* next path of the same prefix (ECMP) */
+    size_t lineno; /* line in the route file, 0 if not loaded from a file */
 };
 
-struct ip_hdr {
-    uint8_t vhl;
-    uint8_t tos;
-    uint16_t total;
-    uint16_t id;
-    uint16_t offset;
-    uint8_t ttl;
-    uint8_t protocol;
-    uint16_t sum;
+/*
+ * NOTE: node of the path-compressed binary trie for longest prefix match.
+ *       prefix is in host byte order, route is NULL for branching nodes.
+ */
+struct ip_route_node {
+    struct ip_route_node *child[2];
+    uint32_t prefix;
+    uint8_t plen;
+    struct ip_route *route;
+};
+
+struct ip_reass_hole {
+    struct ip_reass_hole *next;
+    uint16_t first; /* first byte of the hole */
+    uint16_t last; /* last byte of the hole (inclusive) */
+};
+
+/*
+ * NOTE: the payload is written directly into buf at IP_HDR_SIZE_MAX, and the header
+ *       of the first fragment is placed right before it so that they are contiguous.
+ */
+struct ip_reass {
+    struct ip_reass *next;
     ip_addr_t src;
     ip_addr_t dst;
-    uint8_t options[0];
+    uint16_t id;
+    uint8_t protocol;
+    struct ip_iface *iface;
+    struct ip_reass_hole *holes; /* RFC 815 hole descriptor list */
+    uint16_t hlen; /* header length of the first fragment, 0 until it arrives */
+    uint16_t len; /* payload length, 0 until the last fragment arrives */
+    uint16_t end; /* end of the payload received so far */
+    size_t size; /* allocated size of buf */
+    uint8_t *buf;
+    struct timeval timestamp;
+};
+
+struct ip_pmtu {
+    ip_addr_t dst; /* IP_ADDR_ANY if unused */
+    uint16_t mtu;
+    struct timeval timestamp;
 };
 
 const ip_addr_t IP_ADDR_ANY       = 0x00000000; /* 0.0.0.0 */
@@ -44,8 +100,25 @@ const ip_addr_t IP_ADDR_BROADCAST = 0xffffffff; /* 255.255.255.255 */
 
 /* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
 static struct ip_iface *ifaces;
+static struct ip_iface *iface_hash[IP_IFACE_HASH_SIZE]; /* local unicast addresses */
 static struct ip_protocol *protocols;
 static struct ip_route *routes;
+static struct ip_route_node *route_tree;
+static struct ip_route_node *node_pool; /* preallocated nodes for ip_route_load() */
+static size_t node_pool_num;
+static struct ip_reass *reasses; /* NOTE: accessed only from the input and timer handlers */
+static size_t reass_memory;
+static struct ip_reass_stats reass_stats;
+static mutex_t pmtu_mutex = MUTEX_INITIALIZER; /* NOTE: ip_pmtu() is called from the user threads */
+static struct ip_pmtu pmtus[IP_PMTU_CACHE_SIZE];
+static int forwarding;
+
+static uint32_t dst_cache_gen = 1; /* NOTE: 0 is never used to keep zero-cleared caches invalid */
+
+static int
+ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_addr_t dst, struct ip_dst_cache *cache);
+static int
+ip_output_fragment(struct ip_iface *iface, uint8_t *buf, size_t total, ip_addr_t nexthop, uint16_t mtu, struct ip_dst_cache *cache);
 
 int
 ip_addr_pton(const char *p, ip_addr_t *n)
@@ -135,7 +208,7 @@ ip_dump(const uint8_t *data, size_t len)
     fprintf(stderr, "      total: %u (payload: %u)\n", total, total - hlen);
     fprintf(stderr, "         id: %u\n", ntoh16(hdr->id));
     offset = ntoh16(hdr->offset);
-    fprintf(stderr, "     offset: 0x%04x [flags=%x, offset=%u]\n", offset, (offset & 0xe000) >> 13, offset & 0x1fff);
+    fprintf(stderr, "     offset: 0x%04x [flags=%x, offset=%u]\n", offset, (offset & 0xe000) >> 13, offset & IP_HDR_OFFSET_MASK);
     fprintf(stderr, "        ttl: %u\n", hdr->ttl);
     fprintf(stderr, "   protocol: %u (%s)\n", hdr->protocol, ip_protocol_name(hdr->protocol));
     fprintf(stderr, "        sum: 0x%04x (0x%04x)\n", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)data, hlen, -hdr->sum)));
@@ -147,33 +220,164 @@ ip_dump(const uint8_t *data, size_t len)
     funlockfile(stderr);
 }
 
+/*
+ * IP Routing Table (longest prefix match)
+ */
+
+static uint32_t
+ip_route_mask(uint8_t plen)
+{
+    return plen ? 0xffffffff << (32 - plen) : 0;
+}
+
+static int
+ip_route_bit(uint32_t key, uint8_t pos)
+{
+    return (key >> (31 - pos)) & 0x01;
+}
+
+static int
+ip_route_prefixlen(ip_addr_t netmask)
+{
+    uint32_t mask;
+    int plen = 0;
+
+    mask = ntoh32(netmask);
+    while (mask & 0x80000000) {
+        mask <<= 1;
+        plen++;
+    }
+    return mask ? -1 : plen; /* non-contiguous netmask is not supported */
+}
+
+static struct ip_route_node *
+ip_route_node_alloc(uint32_t prefix, uint8_t plen, struct ip_route *route)
+{
+    struct ip_route_node *node;
+
+    if (node_pool_num) {
+        node = node_pool++;
+        node_pool_num--;
+    } else {
+        node = memory_alloc(sizeof(*node));
+        if (!node) {
+            errorf("memory_alloc() failure");
+            return NULL;
+        }
+    }
+    node->prefix = prefix & ip_route_mask(plen);
+    node->plen = plen;
+    node->route = route;
+    return node;
+}
+
+static int
+ip_route_tree_insert(struct ip_route *route)
+{
+    struct ip_route_node **link, *node, *leaf, *branch;
+    struct ip_route *sibling;
+    uint32_t prefix, diff;
+    uint8_t plen, common = 0;
+
+    plen = route->plen;
+    prefix = ntoh32(route->network) & ip_route_mask(plen);
+    link = &route_tree;
+    while ((node = *link) != NULL) {
+        common = MIN(plen, node->plen);
+        diff = (prefix ^ node->prefix) & ip_route_mask(common);
+        if (diff) {
+            common = __builtin_clz(diff);
+        }
+        if (common != node->plen) {
+            break;
+        }
+        if (plen == node->plen) {
+            if (!node->route) {
+                node->route = route;
+                return 0;
+            }
+            /* same prefix, the route is added as another path of the multipath route */
+            for (sibling = node->route; sibling->sibling; sibling = sibling->sibling);
+            sibling->sibling = route;
+            return 0;
+        }
+        link = &node->child[ip_route_bit(prefix, node->plen)];
+    }
+    leaf = ip_route_node_alloc(prefix, plen, route);
+    if (!leaf) {
+        return -1;
+    }
+    if (!node) {
+        *link = leaf;
+        return 0;
+    }
+    if (common == plen) {
+        /* the new prefix covers the existing node */
+        leaf->child[ip_route_bit(node->prefix, plen)] = node;
+        *link = leaf;
+        return 0;
+    }
+    branch = ip_route_node_alloc(prefix, common, NULL);
+    if (!branch) {
+        memory_free(leaf);
+        return -1;
+    }
+    branch->child[ip_route_bit(prefix, common)] = leaf;
+    branch->child[ip_route_bit(node->prefix, common)] = node;
+    *link = branch;
+    return 0;
+}
+
+static int
+ip_route_link(struct ip_route *route)
+{
+    if (ip_route_tree_insert(route) == -1) {
+        errorf("ip_route_tree_insert() failure");
+        return -1;
+    }
+    route->next = routes;
+    routes = route;
+    ip_dst_cache_invalidate();
+    return 0;
+}
+
 /* NOTE: must not be call after net_run() */
 static struct ip_route *
-ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface)
+ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface, uint8_t weight)
 {
     struct ip_route *route;
+    int plen;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     char addr3[IP_ADDR_STR_LEN];
     char addr4[IP_ADDR_STR_LEN];
 
+    plen = ip_route_prefixlen(netmask);
+    if (plen == -1) {
+        errorf("invalid netmask, netmask=%s", ip_addr_ntop(netmask, addr1, sizeof(addr1)));
+        return NULL;
+    }
     route = memory_alloc(sizeof(*route));
     if (!route) {
         errorf("memory_alloc() failure");
         return NULL;
     }
-    route->network = network;
+    route->network = network & netmask;
     route->netmask = netmask;
     route->nexthop = nexthop;
     route->iface = iface;
-    route->next = routes;
-    routes = route;
-    infof("network=%s, netmask=%s, nexthop=%s, iface=%s dev=%s",
+    route->plen = plen;
+    route->weight = weight;
+    if (ip_route_link(route) == -1) {
+        memory_free(route);
+        return NULL;
+    }
+    infof("network=%s, netmask=%s, nexthop=%s, iface=%s dev=%s, weight=%u",
         ip_addr_ntop(route->network, addr1, sizeof(addr1)),
         ip_addr_ntop(route->netmask, addr2, sizeof(addr2)),
         ip_addr_ntop(route->nexthop, addr3, sizeof(addr3)),
         ip_addr_ntop(route->iface->unicast, addr4, sizeof(addr4)),
-        NET_IFACE(iface)->dev->name
+        NET_IFACE(iface)->dev->name, route->weight
     );
     return route;
 }
@@ -181,18 +385,92 @@ ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_
 static struct ip_route *
 ip_route_lookup(ip_addr_t dst)
 {
-    struct ip_route *route, *candidate = NULL;
+    struct ip_route_node *node;
+    struct ip_route *candidate = NULL;
+    uint32_t key;
 
-    for (route = routes; route; route = route->next) {
-        if ((dst & route->netmask) == route->network) {
-            if (!candidate || ntoh32(candidate->netmask) < ntoh32(route->netmask)) {
-                candidate = route;
-            }
+    key = ntoh32(dst);
+    for (node = route_tree; node; node = node->child[ip_route_bit(key, node->plen)]) {
+        if ((key ^ node->prefix) & ip_route_mask(node->plen)) {
+            break;
+        }
+        if (node->route) {
+            candidate = node->route;
+        }
+        if (node->plen == 32) {
+            break;
         }
     }
     return candidate;
 }
 
+/*
+ * NOTE: hash of the flow for the multipath route selection, the source address is
+ *       not included because it is not decided yet when the source address is selected.
+ *       UDP uses it to spread the flows over the SO_REUSEPORT group as well.
+ */
+uint32_t
+ip_route_flow_hash(uint8_t protocol, ip_addr_t dst, uint16_t sport, uint16_t dport)
+{
+    uint32_t h;
+
+    /* finalizer of MurmurHash3 */
+    h = ntoh32(dst) ^ ((uint32_t)ntoh16(sport) << 16 | ntoh16(dport)) * 0x9e3779b1 ^ protocol;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/* NOTE: data is the payload of the datagram, the ports are taken from the TCP/UDP header */
+static uint32_t
+ip_route_flow_hash_payload(uint8_t protocol, ip_addr_t dst, const uint8_t *data, size_t len)
+{
+    uint16_t sport = 0, dport = 0;
+
+    if ((protocol == IP_PROTOCOL_TCP || protocol == IP_PROTOCOL_UDP) && len >= 4) {
+        /* both TCP and UDP headers start with the source and destination ports */
+        memcpy(&sport, data, sizeof(sport));
+        memcpy(&dport, data + 2, sizeof(dport));
+    }
+    return ip_route_flow_hash(protocol, dst, sport, dport);
+}
+
+/*
+ * NOTE: selects one of the paths of the multipath route by weight, paths that
+ *       cannot use the source address are skipped unless src is IP_ADDR_ANY.
+ */
+static struct ip_route *
+ip_route_select(struct ip_route *route, ip_addr_t src, uint32_t hash)
+{
+    struct ip_route *path;
+    uint32_t total = 0;
+
+    if (!route->sibling) {
+        return (src == IP_ADDR_ANY || src == route->iface->unicast) ? route : NULL;
+    }
+    for (path = route; path; path = path->sibling) {
+        if (src == IP_ADDR_ANY || src == path->iface->unicast) {
+            total += path->weight;
+        }
+    }
+    if (!total) {
+        return NULL;
+    }
+    hash %= total;
+    for (path = route; path; path = path->sibling) {
+        if (src == IP_ADDR_ANY || src == path->iface->unicast) {
+            if (hash < path->weight) {
+                break;
+            }
+            hash -= path->weight;
+        }
+    }
+    return path;
+}
+
 /* NOTE: must not be call after net_run() */
 int
 ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
@@ -203,7 +481,40 @@ ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
         errorf("ip_addr_pton() failure, addr=%s", gateway);
         return -1;
     }
-    if (!ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gw, iface)) {
+    if (!ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gw, iface, IP_ROUTE_WEIGHT_DEFAULT)) {
+        errorf("ip_route_add() failure");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * NOTE: routes added with the same network/netmask form a multipath route,
+ *       and each flow is assigned to one of the paths in proportion to the weight.
+ * NOTE: must not be call after net_run()
+ */
+int
+ip_route_add_path(const char *network, const char *netmask, const char *nexthop, struct ip_iface *iface, uint8_t weight)
+{
+    ip_addr_t n, m, h;
+
+    if (ip_addr_pton(network, &n) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", network);
+        return -1;
+    }
+    if (ip_addr_pton(netmask, &m) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", netmask);
+        return -1;
+    }
+    if (ip_addr_pton(nexthop, &h) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", nexthop);
+        return -1;
+    }
+    if (!weight) {
+        errorf("invalid weight, weight=%u", weight);
+        return -1;
+    }
+    if (!ip_route_add(n, m, h, iface, weight)) {
         errorf("ip_route_add() failure");
         return -1;
     }
@@ -222,6 +533,251 @@ ip_route_get_iface(ip_addr_t dst)
     return route->iface;
 }
 
+/* NOTE: the interface of the path that the flow is hashed to, used to select the source address */
+struct ip_iface *
+ip_route_get_iface_flow(uint8_t protocol, ip_addr_t dst, uint16_t sport, uint16_t dport)
+{
+    struct ip_route *route;
+
+    route = ip_route_lookup(dst);
+    if (!route) {
+        return NULL;
+    }
+    return ip_route_select(route, IP_ADDR_ANY, ip_route_flow_hash(protocol, dst, sport, dport))->iface;
+}
+
+/*
+ * Route Table File
+ *
+ * Each line is "network/prefixlen nexthop [iface] [weight N]", '#' starts a comment.
+ *   - nexthop 0.0.0.0 means directly connected, then iface (unicast address of the ip_iface) is required
+ *   - if iface is omitted, it is taken from the connected route that covers nexthop
+ *   - lines with the same network/prefixlen are the paths of a multipath route (weight defaults to 1)
+ */
+
+static const char *
+ip_route_parse_num(const char *sp, const char *ep, long max, long *n)
+{
+    const char *p;
+
+    *n = 0;
+    for (p = sp; p < ep && *p >= '0' && *p <= '9'; p++) {
+        *n = *n * 10 + (*p - '0');
+        if (*n > max) {
+            return NULL;
+        }
+    }
+    return p == sp ? NULL : p;
+}
+
+static const char *
+ip_route_parse_addr(const char *sp, const char *ep, ip_addr_t *addr)
+{
+    int idx;
+    long n;
+
+    for (idx = 0; idx < IP_ADDR_LEN; idx++) {
+        if (idx) {
+            if (sp >= ep || *sp != '.') {
+                return NULL;
+            }
+            sp++;
+        }
+        sp = ip_route_parse_num(sp, ep, 255, &n);
+        if (!sp) {
+            return NULL;
+        }
+        ((uint8_t *)addr)[idx] = n;
+    }
+    return sp;
+}
+
+static const char *
+ip_route_parse_space(const char *sp, const char *ep)
+{
+    while (sp < ep && (*sp == ' ' || *sp == '\t' || *sp == '\r')) {
+        sp++;
+    }
+    return sp;
+}
+
+/* NOTE: hand-written instead of sscanf(), which dominates the load time of a large table */
+static int
+ip_route_parse(const char *sp, const char *ep, struct ip_route *route)
+{
+    long prefixlen, weight;
+    ip_addr_t addr;
+    struct ip_route *connected;
+
+    sp = ip_route_parse_addr(sp, ep, &route->network);
+    if (!sp || sp >= ep || *sp != '/') {
+        return -1;
+    }
+    sp = ip_route_parse_num(sp + 1, ep, 32, &prefixlen);
+    if (!sp) {
+        return -1;
+    }
+    sp = ip_route_parse_addr(ip_route_parse_space(sp, ep), ep, &route->nexthop);
+    if (!sp) {
+        return -1;
+    }
+    route->plen = prefixlen;
+    route->netmask = hton32(ip_route_mask(prefixlen));
+    route->network &= route->netmask;
+    route->weight = IP_ROUTE_WEIGHT_DEFAULT;
+    sp = ip_route_parse_space(sp, ep);
+    if (sp < ep && *sp >= '0' && *sp <= '9') {
+        sp = ip_route_parse_addr(sp, ep, &addr);
+        if (!sp) {
+            return -1;
+        }
+        route->iface = ip_iface_select(addr);
+    } else if (route->nexthop != IP_ADDR_ANY) {
+        connected = ip_route_lookup(route->nexthop);
+        if (connected && connected->nexthop == IP_ADDR_ANY) {
+            route->iface = connected->iface;
+        }
+    }
+    sp = ip_route_parse_space(sp, ep);
+    if (ep - sp > 6 && !memcmp(sp, "weight", 6)) {
+        sp = ip_route_parse_num(ip_route_parse_space(sp + 6, ep), ep, IP_ROUTE_WEIGHT_MAX, &weight);
+        if (!sp || !weight) {
+            return -1;
+        }
+        route->weight = weight;
+        sp = ip_route_parse_space(sp, ep);
+    }
+    if (sp < ep && *sp != '#') {
+        return -1;
+    }
+    return route->iface ? 0 : -1;
+}
+
+static int
+ip_route_cmp(const void *a, const void *b)
+{
+    const struct ip_route *r1 = a, *r2 = b;
+    uint32_t n1, n2;
+
+    n1 = ntoh32(r1->network);
+    n2 = ntoh32(r2->network);
+    if (n1 != n2) {
+        return n1 < n2 ? -1 : 1;
+    }
+    if (r1->plen != r2->plen) {
+        return r1->plen < r2->plen ? -1 : 1;
+    }
+    /* keep the file order for the same prefix, qsort() is not stable */
+    if (r1->lineno != r2->lineno) {
+        return r1->lineno < r2->lineno ? -1 : 1;
+    }
+    return 0;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ip_route_load(const char *path)
+{
+    int fd;
+    struct stat st;
+    char *map, *sp, *ep, *tail;
+    size_t num = 0, idx, lineno = 0;
+    struct ip_route *table;
+    struct ip_route_node *pool;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        errorf("open: %s, path=%s", strerror(errno), path);
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        errorf("fstat: %s, path=%s", strerror(errno), path);
+        close(fd);
+        return -1;
+    }
+    if (!st.st_size) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        errorf("mmap: %s, path=%s", strerror(errno), path);
+        return -1;
+    }
+    tail = map + st.st_size;
+    /* first pass: count lines to allocate all of the routes at once */
+    for (sp = map; sp < tail; sp++) {
+        if (*sp == '\n') {
+            num++;
+        }
+    }
+    num++;
+    table = memory_alloc(sizeof(*table) * num);
+    if (!table) {
+        errorf("memory_alloc() failure");
+        munmap(map, st.st_size);
+        return -1;
+    }
+    /* second pass: parse all lines before touching the routing table */
+    idx = 0;
+    for (sp = map; sp < tail; sp = ep + 1) {
+        ep = memchr(sp, '\n', tail - sp);
+        if (!ep) {
+            ep = tail;
+        }
+        lineno++;
+        sp = (char *)ip_route_parse_space(sp, ep);
+        if (sp == ep || *sp == '#') {
+            continue;
+        }
+        if (ip_route_parse(sp, ep, &table[idx]) == -1) {
+            errorf("invalid route, path=%s, line=%zu", path, lineno);
+            memory_free(table);
+            munmap(map, st.st_size);
+            return -1;
+        }
+        table[idx].lineno = lineno;
+        idx++;
+    }
+    munmap(map, st.st_size);
+    if (!idx) {
+        memory_free(table);
+        return 0;
+    }
+    /* each insertion adds a leaf and at most one branching node */
+    pool = memory_alloc(sizeof(*pool) * idx * 2);
+    if (!pool) {
+        errorf("memory_alloc() failure");
+        memory_free(table);
+        return -1;
+    }
+    /* inserting in prefix order keeps the walked path hot in the cache */
+    qsort(table, idx, sizeof(*table), ip_route_cmp);
+    node_pool = pool;
+    node_pool_num = idx * 2;
+    for (num = 0; num < idx; num++) {
+        ip_route_link(&table[num]); /* never fails, nodes come from the pool */
+    }
+    node_pool = NULL;
+    node_pool_num = 0;
+    infof("loaded %zu routes, path=%s", idx, path);
+    return 0;
+}
+
+static uint32_t
+ip_iface_hash(ip_addr_t addr)
+{
+    uint32_t h;
+
+    /* the low-order bits of the addresses in a subnet differ, mix them into the bucket index */
+    h = ntoh32(addr);
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h & (IP_IFACE_HASH_SIZE - 1);
+}
+
 struct ip_iface *
 ip_iface_alloc(const char *unicast, const char *netmask)
 {
@@ -251,20 +807,33 @@ ip_iface_alloc(const char *unicast, const char *netmask)
 int
 ip_iface_register(struct net_device *dev, struct ip_iface *iface)
 {
+    struct ip_route *connected;
+    struct ip_iface **bucket;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     char addr3[IP_ADDR_STR_LEN];
 
+    if (ip_iface_select(iface->unicast)) {
+        errorf("already exists, addr=%s", ip_addr_ntop(iface->unicast, addr1, sizeof(addr1)));
+        return -1;
+    }
     if (net_device_add_iface(dev, NET_IFACE(iface)) == -1) {
         errorf("net_device_add_iface() failure");
         return -1;
     }
-    if (!ip_route_add(iface->unicast & iface->netmask, iface->netmask, IP_ADDR_ANY, iface)) {
-        errorf("ip_route_add() failure");
-        return -1;
+    connected = ip_route_lookup(iface->unicast);
+    if (!connected || connected->nexthop != IP_ADDR_ANY || connected->netmask != iface->netmask || NET_IFACE(connected->iface)->dev != dev) {
+        /* NOTE: the secondary addresses in the same subnet share the connected route of the primary one */
+        if (!ip_route_add(iface->unicast & iface->netmask, iface->netmask, IP_ADDR_ANY, iface, IP_ROUTE_WEIGHT_DEFAULT)) {
+            errorf("ip_route_add() failure");
+            return -1;
+        }
     }
     iface->next = ifaces;
     ifaces = iface;
+    bucket = &iface_hash[ip_iface_hash(iface->unicast)];
+    iface->hnext = *bucket;
+    *bucket = iface;
     infof("registered: dev=%s, unicast=%s, netmask=%s, broadcast=%s",
         dev->name,
         ip_addr_ntop(iface->unicast, addr1, sizeof(addr1)),
@@ -273,12 +842,13 @@ ip_iface_register(struct net_device *dev, struct ip_iface *iface)
     return 0;
 }
 
+/* NOTE: returns the interface that has the unicast address, it does not walk the ifaces list */
 struct ip_iface *
 ip_iface_select(ip_addr_t addr)
 {
     struct ip_iface *entry;
 
-    for (entry = ifaces; entry; entry = entry->next) {
+    for (entry = iface_hash[ip_iface_hash(addr)]; entry; entry = entry->hnext) {
         if (entry->unicast == addr) {
             break;
         }
@@ -286,43 +856,597 @@ ip_iface_select(ip_addr_t addr)
     return entry;
 }
 
-static void
-ip_input(const uint8_t *data, size_t len, struct net_device *dev)
+/* NOTE: returns the interface of the device whose directed broadcast address is addr */
+static struct ip_iface *
+ip_iface_select_broadcast(struct net_device *dev, ip_addr_t addr)
 {
-    struct ip_hdr *hdr;
-    uint8_t v;
-    uint16_t hlen, total, offset;
-    struct ip_iface *iface;
-    char addr[IP_ADDR_STR_LEN];
-    struct ip_protocol *proto;
+    struct net_iface *entry;
 
-    if (len < IP_HDR_SIZE_MIN) {
-        errorf("too short");
-        return;
+    for (entry = dev->ifaces; entry; entry = entry->next) {
+        if (entry->family == NET_IFACE_FAMILY_IP && ((struct ip_iface *)entry)->broadcast == addr) {
+            break;
+        }
     }
-    hdr = (struct ip_hdr *)data;
-    v = hdr->vhl >> 4;
-    if (v != IP_VERSION_IPV4) {
-        errorf("ip version error: v=%u", v);
-        return;
+    return (struct ip_iface *)entry;
+}
+
+static void
+ip_reass_free(struct ip_reass *reass)
+{
+    struct ip_reass_hole *hole;
+
+    while (reass->holes) {
+        hole = reass->holes;
+        reass->holes = hole->next;
+        memory_free(hole);
+        reass_memory -= sizeof(*hole);
     }
-    hlen = (hdr->vhl & 0x0f) << 2;
-    if (len < hlen) {
-        errorf("header length error: hlen=%u, len=%u", hlen, len);
-        return;
+    memory_free(reass->buf);
+    reass_memory -= sizeof(*reass) + reass->size;
+    memory_free(reass);
+}
+
+static void
+ip_reass_delete(struct ip_reass *reass)
+{
+    struct ip_reass *entry, *prev = NULL;
+
+    for (entry = reasses; entry; prev = entry, entry = entry->next) {
+        if (entry == reass) {
+            if (prev) {
+                prev->next = entry->next;
+            } else {
+                reasses = entry->next;
+            }
+            ip_reass_free(entry);
+            return;
+        }
     }
-    total = ntoh16(hdr->total);
-    if (len < total) {
-        errorf("total length error: total=%u, len=%u", total, len);
-        return;
+}
+
+/* NOTE: drop the oldest datagrams until the requested size fits within the memory cap */
+static int
+ip_reass_reserve(size_t size, struct ip_reass *keep)
+{
+    struct ip_reass *entry, *oldest;
+
+    while (reass_memory + size > IP_REASS_MEMORY_MAX) {
+        oldest = NULL;
+        for (entry = reasses; entry; entry = entry->next) {
+            if (entry == keep) {
+                continue;
+            }
+            if (!oldest || timercmp(&entry->timestamp, &oldest->timestamp, <)) {
+                oldest = entry;
+            }
+        }
+        if (!oldest) {
+            return -1;
+        }
+        reass_stats.drops++;
+        ip_reass_delete(oldest);
     }
-    if (cksum16((uint16_t *)hdr, hlen, 0) != 0) {
-        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, hlen, -hdr->sum)));
-        return;
+    reass_memory += size;
+    return 0;
+}
+
+static struct ip_reass_hole *
+ip_reass_hole_alloc(uint16_t first, uint16_t last, struct ip_reass *reass)
+{
+    struct ip_reass_hole *hole;
+
+    if (ip_reass_reserve(sizeof(*hole), reass) == -1) {
+        return NULL;
+    }
+    hole = memory_alloc(sizeof(*hole));
+    if (!hole) {
+        errorf("memory_alloc() failure");
+        reass_memory -= sizeof(*hole);
+        return NULL;
+    }
+    hole->first = first;
+    hole->last = last;
+    return hole;
+}
+
+static struct ip_reass *
+ip_reass_alloc(const struct ip_hdr *hdr, struct ip_iface *iface)
+{
+    struct ip_reass *reass;
+
+    if (ip_reass_reserve(sizeof(*reass), NULL) == -1) {
+        return NULL;
+    }
+    reass = memory_alloc(sizeof(*reass));
+    if (!reass) {
+        errorf("memory_alloc() failure");
+        reass_memory -= sizeof(*reass);
+        return NULL;
+    }
+    reass->src = hdr->src;
+    reass->dst = hdr->dst;
+    reass->id = hdr->id;
+    reass->protocol = hdr->protocol;
+    reass->iface = iface;
+    reass->holes = ip_reass_hole_alloc(0, IP_PAYLOAD_SIZE_MAX, reass);
+    if (!reass->holes) {
+        reass_memory -= sizeof(*reass);
+        memory_free(reass);
+        return NULL;
+    }
+    gettimeofday(&reass->timestamp, NULL);
+    reass->next = reasses;
+    reasses = reass;
+    return reass;
+}
+
+static struct ip_reass *
+ip_reass_lookup(const struct ip_hdr *hdr)
+{
+    struct ip_reass *reass;
+
+    for (reass = reasses; reass; reass = reass->next) {
+        if (reass->id == hdr->id && reass->src == hdr->src && reass->dst == hdr->dst && reass->protocol == hdr->protocol) {
+            return reass;
+        }
+    }
+    return NULL;
+}
+
+/* NOTE: the buffer grows geometrically because the total length is unknown until the last fragment arrives */
+static int
+ip_reass_grow(struct ip_reass *reass, size_t end)
+{
+    size_t size;
+    uint8_t *buf;
+
+    if (IP_HDR_SIZE_MAX + end <= reass->size) {
+        return 0;
+    }
+    size = MAX(reass->size * 2, IP_REASS_BUFSIZ_MIN);
+    size = MAX(size, IP_HDR_SIZE_MAX + end);
+    size = MIN(size, IP_HDR_SIZE_MAX + IP_PAYLOAD_SIZE_MAX);
+    if (ip_reass_reserve(size - reass->size, reass) == -1) {
+        return -1;
     }
+    buf = memory_alloc(size);
+    if (!buf) {
+        errorf("memory_alloc() failure");
+        reass_memory -= size - reass->size;
+        return -1;
+    }
+    if (reass->buf) {
+        memcpy(buf, reass->buf, reass->size);
+        memory_free(reass->buf);
+    }
+    reass->buf = buf;
+    reass->size = size;
+    return 0;
+}
+
+/*
+ * NOTE: hole filling algorithm of RFC 815. Only the parts of the fragment that fall
+ *       into holes are copied, so data that has been received first always wins.
+ */
+static int
+ip_reass_fill(struct ip_reass *reass, const uint8_t *data, uint16_t first, uint16_t last, int more)
+{
+    struct ip_reass_hole *hole, *prev = NULL, *next, *tail;
+    size_t filled = 0;
+    uint16_t lo, hi;
+
+    for (hole = reass->holes; hole; hole = next) {
+        next = hole->next;
+        if (first > hole->last || last < hole->first) {
+            prev = hole;
+            continue;
+        }
+        lo = MAX(first, hole->first);
+        hi = MIN(last, hole->last);
+        memcpy(reass->buf + IP_HDR_SIZE_MAX + lo, data + (lo - first), hi - lo + 1);
+        filled += hi - lo + 1;
+        /* the hole is replaced by up to two smaller holes */
+        if (first > hole->first) {
+            tail = ip_reass_hole_alloc(hole->first, first - 1, reass);
+            if (!tail) {
+                return -1;
+            }
+            tail->next = hole;
+            if (prev) {
+                prev->next = tail;
+            } else {
+                reass->holes = tail;
+            }
+            prev = tail;
+        }
+        if (last < hole->last && more) {
+            hole->first = last + 1;
+            prev = hole;
+            continue;
+        }
+        if (prev) {
+            prev->next = next;
+        } else {
+            reass->holes = next;
+        }
+        memory_free(hole);
+        reass_memory -= sizeof(*hole);
+    }
+    if (filled != (size_t)(last - first + 1)) {
+        reass_stats.overlaps++;
+    }
+    if (!more) {
+        /* the last fragment: there are no holes beyond the end of the datagram */
+        for (prev = NULL, hole = reass->holes; hole; hole = next) {
+            next = hole->next;
+            if (hole->first > last) {
+                if (prev) {
+                    prev->next = next;
+                } else {
+                    reass->holes = next;
+                }
+                memory_free(hole);
+                reass_memory -= sizeof(*hole);
+                continue;
+            }
+            prev = hole;
+        }
+    }
+    return 0;
+}
+
+/*
+ * NOTE: returns the reassembly entry when the datagram is completed, the caller must
+ *       delete it after delivery. returns NULL while waiting for the other fragments.
+ */
+static struct ip_reass *
+ip_reass_input(const struct ip_hdr *hdr, struct ip_iface *iface)
+{
+    uint16_t hlen, offset, first, last;
+    struct ip_reass *reass;
+    size_t limit;
+    int more;
+
+    hlen = (hdr->vhl & 0x0f) << 2;
     offset = ntoh16(hdr->offset);
-    if (offset & 0x2000 || offset & 0x1fff) {
-        errorf("fragments does not support");
+    more = offset & IP_HDR_FLAG_MF;
+    first = (offset & IP_HDR_OFFSET_MASK) << 3;
+    if (ntoh16(hdr->total) == hlen) {
+        errorf("empty fragment");
+        return NULL;
+    }
+    reass = ip_reass_lookup(hdr);
+    /* the reassembled datagram must fit in IP_TOTAL_SIZE_MAX with the header of the first fragment */
+    limit = IP_TOTAL_SIZE_MAX - (reass && reass->hlen ? reass->hlen : (first ? IP_HDR_SIZE_MIN : hlen));
+    if ((size_t)first + (ntoh16(hdr->total) - hlen) > limit) {
+        errorf("too long fragment, offset=%u, len=%u", first, ntoh16(hdr->total) - hlen);
+        return NULL;
+    }
+    last = first + (ntoh16(hdr->total) - hlen) - 1;
+    if (more && (last - first + 1) & 7) {
+        errorf("fragment size is not a multiple of 8 bytes, len=%u", last - first + 1);
+        return NULL;
+    }
+    /* the end of the datagram is fixed by the last fragment, a fragment that disagrees with it makes the datagram unreliable */
+    if (reass && ((reass->len && (last + 1 > reass->len || (!more && last + 1 != reass->len))) || (!more && last + 1 < reass->end))) {
+        errorf("inconsistent end of the datagram, len=%u, end=%u, offset=%u, last=%u", reass->len, reass->end, first, last);
+        reass_stats.drops++;
+        ip_reass_delete(reass);
+        return NULL;
+    }
+    if (!reass) {
+        reass = ip_reass_alloc(hdr, iface);
+        if (!reass) {
+            errorf("ip_reass_alloc() failure");
+            return NULL;
+        }
+    }
+    if (ip_reass_grow(reass, last + 1) == -1 || ip_reass_fill(reass, (uint8_t *)hdr + hlen, first, last, more) == -1) {
+        errorf("memory limit exceeded, drop the datagram");
+        reass_stats.drops++;
+        ip_reass_delete(reass);
+        return NULL;
+    }
+    if (!first && !reass->hlen) {
+        reass->hlen = hlen;
+        memcpy(reass->buf + IP_HDR_SIZE_MAX - hlen, hdr, hlen);
+    }
+    reass->end = MAX(reass->end, last + 1);
+    if (!more) {
+        reass->len = last + 1;
+    }
+    if (reass->holes) {
+        return NULL;
+    }
+    /* the fragments received before the first one were checked against the minimum header */
+    if (reass->hlen + reass->len > IP_TOTAL_SIZE_MAX) {
+        errorf("too long datagram, hlen=%u, len=%u", reass->hlen, reass->len);
+        reass_stats.drops++;
+        ip_reass_delete(reass);
+        return NULL;
+    }
+    return reass;
+}
+
+static void
+ip_reass_timer(void)
+{
+    struct ip_reass *reass, *next;
+    struct timeval now, diff;
+
+    gettimeofday(&now, NULL);
+    for (reass = reasses; reass; reass = next) {
+        next = reass->next;
+        timersub(&now, &reass->timestamp, &diff);
+        if (diff.tv_sec >= IP_REASS_TIMEOUT) {
+            reass_stats.timeouts++;
+            if (reass->hlen) {
+                /* the header and the first 64 bits of the first fragment (RFC 792) */
+                icmp_error(ICMP_TYPE_TIME_EXCEEDED, ICMP_CODE_EXCEEDED_FRAGMENT, 0,
+                    reass->buf + IP_HDR_SIZE_MAX - reass->hlen, reass->hlen + 8, reass->iface);
+            }
+            ip_reass_delete(reass);
+        }
+    }
+}
+
+void
+ip_reass_stats(struct ip_reass_stats *stats)
+{
+    *stats = reass_stats;
+}
+
+/*
+ * Path MTU Discovery (RFC 1191)
+ */
+
+/* NOTE: must be called with pmtu_mutex locked */
+static struct ip_pmtu *
+ip_pmtu_select(ip_addr_t dst)
+{
+    struct ip_pmtu *entry;
+
+    for (entry = pmtus; entry < tailof(pmtus); entry++) {
+        if (entry->dst != IP_ADDR_ANY && entry->dst == dst) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* NOTE: must be called with pmtu_mutex locked */
+static struct ip_pmtu *
+ip_pmtu_alloc(void)
+{
+    struct ip_pmtu *entry, *oldest = NULL;
+
+    for (entry = pmtus; entry < tailof(pmtus); entry++) {
+        if (entry->dst == IP_ADDR_ANY) {
+            return entry;
+        }
+        if (!oldest || timercmp(&oldest->timestamp, &entry->timestamp, >)) {
+            oldest = entry;
+        }
+    }
+    return oldest;
+}
+
+/* NOTE: mtu is the MTU of the first hop */
+static uint16_t
+ip_pmtu_lookup(ip_addr_t dst, uint16_t mtu)
+{
+    struct ip_pmtu *entry;
+
+    mutex_lock(&pmtu_mutex);
+    entry = ip_pmtu_select(dst);
+    if (entry) {
+        mtu = MIN(mtu, entry->mtu);
+    }
+    mutex_unlock(&pmtu_mutex);
+    return mtu;
+}
+
+/* NOTE: returns the MTU of the path to dst, or 0 if there is no route */
+uint16_t
+ip_pmtu(ip_addr_t dst)
+{
+    struct ip_route *route;
+    uint16_t mtu;
+
+    route = ip_route_lookup(dst);
+    if (!route) {
+        return 0;
+    }
+    /* the flow may be hashed to any of the multipath route */
+    for (mtu = NET_IFACE(route->iface)->dev->mtu; route; route = route->sibling) {
+        mtu = MIN(mtu, NET_IFACE(route->iface)->dev->mtu);
+    }
+    return ip_pmtu_lookup(dst, mtu);
+}
+
+/*
+ * NOTE: mtu is the Next-Hop MTU of the ICMP message, total is the total length of the
+ *       original datagram which is used to estimate the MTU when the router does not
+ *       support RFC 1191 (Next-Hop MTU is zero).
+ */
+void
+ip_pmtu_update(ip_addr_t dst, uint16_t mtu, uint16_t total)
+{
+    /* see RFC 1191 section 7 */
+    static const uint16_t plateaus[] = {32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, IP_PMTU_MIN};
+    struct ip_pmtu *entry;
+    char addr[IP_ADDR_STR_LEN];
+    size_t i;
+
+    if (!mtu) {
+        for (i = 0; i < countof(plateaus); i++) {
+            if (plateaus[i] < total) {
+                break;
+            }
+        }
+        mtu = (i < countof(plateaus)) ? plateaus[i] : IP_PMTU_MIN;
+    }
+    mtu = MAX(mtu, IP_PMTU_MIN);
+    mutex_lock(&pmtu_mutex);
+    entry = ip_pmtu_select(dst);
+    if (entry && entry->mtu <= mtu) {
+        /* never raise the estimate by an ICMP message, it is reset by aging */
+        mutex_unlock(&pmtu_mutex);
+        return;
+    }
+    if (!entry) {
+        entry = ip_pmtu_alloc();
+        entry->dst = dst;
+    }
+    entry->mtu = mtu;
+    gettimeofday(&entry->timestamp, NULL);
+    mutex_unlock(&pmtu_mutex);
+    ip_dst_cache_invalidate();
+    infof("dst=%s, mtu=%u", ip_addr_ntop(dst, addr, sizeof(addr)), mtu);
+}
+
+static void
+ip_pmtu_timer(void)
+{
+    struct ip_pmtu *entry;
+    struct timeval now, diff;
+
+    mutex_lock(&pmtu_mutex);
+    gettimeofday(&now, NULL);
+    for (entry = pmtus; entry < tailof(pmtus); entry++) {
+        if (entry->dst == IP_ADDR_ANY) {
+            continue;
+        }
+        timersub(&now, &entry->timestamp, &diff);
+        if (diff.tv_sec >= IP_PMTU_TIMEOUT) {
+            /* try the first-hop MTU again */
+            entry->dst = IP_ADDR_ANY;
+            ip_dst_cache_invalidate();
+        }
+    }
+    mutex_unlock(&pmtu_mutex);
+}
+
+/*
+ * Forwarding
+ */
+
+/* NOTE: must not be call after net_run() */
+void
+ip_forwarding(int enable)
+{
+    forwarding = enable;
+    infof("%s", enable ? "enabled" : "disabled");
+}
+
+/* NOTE: incremental update of the checksum when a 16-bit field changes from m to m_ (RFC 1624 eqn. 3) */
+static uint16_t
+ip_cksum_adjust(uint16_t sum, uint16_t m, uint16_t m_)
+{
+    uint32_t acc;
+
+    acc = (uint16_t)~sum + (uint16_t)~m + m_;
+    acc = (acc & 0xffff) + (acc >> 16);
+    acc = (acc & 0xffff) + (acc >> 16);
+    return ~acc;
+}
+
+/*
+ * NOTE: the datagram is modified in place and sent as is, it is not rebuilt by ip_output_core().
+ *       data must be writable (protocol handlers receive the copy queued by net_input_handler()).
+ */
+static void
+ip_forward(uint8_t *data, size_t len, struct ip_iface *iface)
+{
+    struct ip_hdr *hdr;
+    uint16_t hlen, total, old, mtu;
+    struct ip_route *route;
+    uint32_t hash;
+    ip_addr_t nexthop;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+
+    hdr = (struct ip_hdr *)data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    total = ntoh16(hdr->total);
+    /* the forwarded datagrams are not reassembled, the filter tracks the fragments */
+    if (acl_filter_datagram(ACL_DIR_IN, data, total) == ACL_ACTION_DROP) {
+        return;
+    }
+    if (hdr->ttl <= IP_FORWARD_TTL_MIN) {
+        icmp_error(ICMP_TYPE_TIME_EXCEEDED, ICMP_CODE_EXCEEDED_TTL, 0, data, total, iface);
+        return;
+    }
+    route = ip_route_lookup(hdr->dst);
+    if (!route) {
+        debugf("no route to host, dst=%s", ip_addr_ntop(hdr->dst, addr1, sizeof(addr1)));
+        icmp_error(ICMP_TYPE_DEST_UNREACH, ICMP_CODE_NET_UNREACH, 0, data, total, iface);
+        return;
+    }
+    if (route->sibling) {
+        /* all fragments of a datagram must take the same path, so they are hashed without the ports */
+        if (ntoh16(hdr->offset) & (IP_HDR_FLAG_MF | IP_HDR_OFFSET_MASK)) {
+            hash = ip_route_flow_hash(hdr->protocol, hdr->dst, 0, 0);
+        } else {
+            hash = ip_route_flow_hash_payload(hdr->protocol, hdr->dst, data + hlen, total - hlen);
+        }
+        route = ip_route_select(route, IP_ADDR_ANY, hash ^ ntoh32(hdr->src));
+    }
+    mtu = NET_IFACE(route->iface)->dev->mtu;
+    if (mtu < total && (ntoh16(hdr->offset) & IP_HDR_FLAG_DF)) {
+        debugf("too long with DF, dev=%s, mtu=%u, total=%u", NET_IFACE(route->iface)->dev->name, mtu, total);
+        /* Next-Hop MTU is in the low-order 16 bits (RFC 1191) */
+        icmp_error(ICMP_TYPE_DEST_UNREACH, ICMP_CODE_FRAGMENT_NEEDED, hton32(mtu), data, total, iface);
+        return;
+    }
+    /* TTL shares the 16-bit word with the protocol field */
+    old = hdr->ttl << 8 | hdr->protocol;
+    hdr->ttl--;
+    hdr->sum = hton16(ip_cksum_adjust(ntoh16(hdr->sum), old, hdr->ttl << 8 | hdr->protocol));
+    nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : hdr->dst;
+    debugf("%s => %s, dev=%s, ttl=%u, len=%u",
+        ip_addr_ntop(hdr->src, addr1, sizeof(addr1)), ip_addr_ntop(hdr->dst, addr2, sizeof(addr2)),
+        NET_IFACE(route->iface)->dev->name, hdr->ttl, total);
+    if (mtu < total) {
+        ip_output_fragment(route->iface, data, total, nexthop, mtu, NULL);
+        return;
+    }
+    ip_output_device(route->iface, data, total, nexthop, NULL);
+}
+
+static void
+ip_input(const uint8_t *data, size_t len, struct net_device *dev)
+{
+    struct ip_hdr *hdr;
+    uint8_t v;
+    uint16_t hlen, total, offset;
+    struct ip_iface *iface, *other;
+    char addr[IP_ADDR_STR_LEN];
+    struct ip_protocol *proto;
+    struct ip_reass *reass = NULL;
+
+    if (len < IP_HDR_SIZE_MIN) {
+        errorf("too short");
+        return;
+    }
+    hdr = (struct ip_hdr *)data;
+    v = hdr->vhl >> 4;
+    if (v != IP_VERSION_IPV4) {
+        errorf("ip version error: v=%u", v);
+        return;
+    }
+    hlen = (hdr->vhl & 0x0f) << 2;
+    if (len < hlen) {
+        errorf("header length error: hlen=%u, len=%u", hlen, len);
+        return;
+    }
+    total = ntoh16(hdr->total);
+    if (len < total) {
+        errorf("total length error: total=%u, len=%u", total, len);
+        return;
+    }
+    if (cksum16((uint16_t *)hdr, hlen, 0) != 0) {
+        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, hlen, -hdr->sum)));
         return;
     }
     iface = (struct ip_iface *)net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
@@ -330,26 +1454,63 @@ ip_input(const uint8_t *data, size_t len, struct net_device *dev)
         /* iface is not registered to the device */
         return;
     }
-    if (hdr->dst != iface->unicast) {
-        if (hdr->dst != iface->broadcast && hdr->dst != IP_ADDR_BROADCAST) {
+    other = ip_iface_select(hdr->dst);
+    if (other) {
+        if (NET_IFACE(other)->dev != dev && !forwarding) {
+            /* the address of the other device (strong host model) */
+            return;
+        }
+        iface = other;
+    } else if (hdr->dst != IP_ADDR_BROADCAST) {
+        other = ip_iface_select_broadcast(dev, hdr->dst);
+        if (!other) {
             /* for other host */
+            if (forwarding) {
+                ip_forward((uint8_t *)data, total, iface);
+            }
+            return;
+        }
+        iface = other;
+    }
+    offset = ntoh16(hdr->offset);
+    if (offset & IP_HDR_FLAG_MF || offset & IP_HDR_OFFSET_MASK) {
+        debugf("fragment, id=%u, offset=0x%04x, len=%u", ntoh16(hdr->id), offset, total);
+        reass = ip_reass_input(hdr, iface);
+        if (!reass) {
             return;
         }
+        hdr = (struct ip_hdr *)(reass->buf + IP_HDR_SIZE_MAX - reass->hlen);
+        hlen = reass->hlen;
+        total = hlen + reass->len;
+        hdr->total = hton16(total);
+        hdr->offset = 0;
+        iface = reass->iface;
     }
     debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
         dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(hdr->protocol), hdr->protocol, total);
-    ip_dump(data, total);
-    for (proto = protocols; proto; proto = proto->next) {
-        if (proto->type == hdr->protocol) {
-            proto->handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, iface);
-            return;
+    ip_dump((uint8_t *)hdr, total);
+    /* the filter sees reassembled datagrams, so the ports are always available */
+    if (acl_filter(ACL_DIR_IN, hdr->protocol, hdr->src, hdr->dst, (uint8_t *)hdr + hlen, total - hlen) != ACL_ACTION_DROP) {
+        for (proto = protocols; proto; proto = proto->next) {
+            if (proto->type == hdr->protocol) {
+                if (proto->handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, iface) == IP_PROTOCOL_PORT_UNREACH) {
+                    icmp_error(ICMP_TYPE_DEST_UNREACH, ICMP_CODE_PORT_UNREACH, 0, (uint8_t *)hdr, total, iface);
+                }
+                break;
+            }
+        }
+        if (!proto) {
+            icmp_error(ICMP_TYPE_DEST_UNREACH, ICMP_CODE_PROTO_UNREACH, 0, (uint8_t *)hdr, total, iface);
         }
     }
-    /* unsupported protocol */
+    if (reass) {
+        ip_reass_delete(reass);
+    }
 }
 
+/* NOTE: the resolved hardware address is kept in the cache (if any) and reused while the cache is valid */
 static int
-ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_addr_t dst)
+ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_addr_t dst, struct ip_dst_cache *cache)
 {
     uint8_t hwaddr[NET_DEVICE_ADDR_LEN] = {};
     int ret;
@@ -357,18 +1518,110 @@ ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_add
     if (NET_IFACE(iface)->dev->flags & NET_DEVICE_FLAG_NEED_ARP) {
         if (dst == iface->broadcast || dst == IP_ADDR_BROADCAST) {
             memcpy(hwaddr, NET_IFACE(iface)->dev->broadcast, NET_IFACE(iface)->dev->alen);
+        } else if (cache && cache->resolved) {
+            memcpy(hwaddr, cache->ha, NET_IFACE(iface)->dev->alen);
         } else {
             ret = arp_resolve(NET_IFACE(iface), dst, hwaddr);
             if (ret != ARP_RESOLVE_FOUND) {
                 return ret;
             }
+            if (cache) {
+                memcpy(cache->ha, hwaddr, NET_IFACE(iface)->dev->alen);
+                cache->resolved = 1;
+            }
         }
     }
     return net_device_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, data, len, hwaddr);
 }
 
+/*
+ * NOTE: splits the datagram into IP fragments that fit the MTU. The header of each fragment
+ *       is written in place right before its payload, over the tail of the previous fragment
+ *       which has already been passed to the device, so the payload is never copied again.
+ */
+static int
+ip_output_fragment(struct ip_iface *iface, uint8_t *buf, size_t total, ip_addr_t nexthop, uint16_t mtu, struct ip_dst_cache *cache)
+{
+    struct ip_hdr orig, *hdr;
+    uint16_t hlen, base, flags;
+    size_t max, off, slen, len;
+    int ret;
+
+    memcpy(&orig, buf, sizeof(orig));
+    hlen = (orig.vhl & 0x0f) << 2;
+    /* a forwarded datagram may already be a fragment */
+    base = ntoh16(orig.offset);
+    len = total - hlen;
+    /* fragment data size must be a multiple of 8 bytes except for the last one */
+    max = (mtu - hlen) & ~7;
+    if (!max) {
+        errorf("mtu too small, dev=%s, mtu=%u", NET_IFACE(iface)->dev->name, mtu);
+        return -1;
+    }
+    for (off = 0; off < len; off += slen) {
+        slen = MIN(len - off, max);
+        flags = (off + slen < len) ? IP_HDR_FLAG_MF : (base & IP_HDR_FLAG_MF);
+        hdr = (struct ip_hdr *)(buf + off);
+        memcpy(hdr, &orig, hlen);
+        hdr->total = hton16(hlen + slen);
+        hdr->offset = hton16(flags | ((base & IP_HDR_OFFSET_MASK) + (off >> 3)));
+        hdr->sum = 0;
+        hdr->sum = cksum16((uint16_t *)hdr, hlen, 0);
+        ret = ip_output_device(iface, (uint8_t *)hdr, hlen + slen, nexthop, cache);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * NOTE: splits the super-segment into transport segments that fit the MTU, each of them is a
+ *       complete datagram with the copy of the IP and transport headers fixed up by the protocol.
+ *       the headers are written in place in the same way as ip_output_fragment().
+ */
+static int
+ip_output_gso(struct ip_iface *iface, uint8_t *buf, size_t total, ip_addr_t nexthop, uint16_t mtu, const struct ip_gso *gso, struct ip_dst_cache *cache)
+{
+    uint8_t orig[IP_HDR_SIZE_MAX + IP_GSO_HDR_SIZE_MAX];
+    struct ip_hdr *hdr;
+    uint16_t hlen, id;
+    size_t max, off, slen, len;
+    int ret;
+
+    hlen = (((struct ip_hdr *)buf)->vhl & 0x0f) << 2;
+    if (gso->hlen > IP_GSO_HDR_SIZE_MAX || mtu <= hlen + gso->hlen) {
+        errorf("unable to segment, dev=%s, mtu=%u", NET_IFACE(iface)->dev->name, mtu);
+        return -1;
+    }
+    memcpy(orig, buf, hlen + gso->hlen);
+    /* the ids from the one in the header are reserved for the segments by ip_output_id_num() */
+    id = ntoh16(((struct ip_hdr *)orig)->id);
+    len = total - (hlen + gso->hlen);
+    max = mtu - (hlen + gso->hlen);
+    for (off = 0; off < len; off += slen) {
+        slen = MIN(len - off, max);
+        hdr = (struct ip_hdr *)(buf + off);
+        memcpy(hdr, orig, hlen + gso->hlen);
+        hdr->total = hton16(hlen + gso->hlen + slen);
+        hdr->id = hton16(id++);
+        hdr->sum = 0;
+        hdr->sum = cksum16((uint16_t *)hdr, hlen, 0);
+        gso->fixup((uint8_t *)hdr + hlen, gso->hlen + slen, off, off + slen == len, hdr->src, hdr->dst);
+        ret = ip_output_device(iface, (uint8_t *)hdr, hlen + gso->hlen + slen, nexthop, cache);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * NOTE: the whole datagram is built at once and split into wire-sized frames only at the
+ *       device step, devices with a large MTU (e.g. loopback) receive it without splitting.
+ */
 static ssize_t
-ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset)
+ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint8_t tos, uint16_t id, uint16_t mtu, const struct ip_gso *gso, struct ip_dst_cache *cache)
 {
     uint8_t buf[IP_TOTAL_SIZE_MAX];
     struct ip_hdr *hdr;
@@ -378,11 +1631,12 @@ ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, si
     hdr = (struct ip_hdr *)buf;
     hlen = sizeof(*hdr);
     hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
-    hdr->tos = 0;
+    hdr->tos = tos;
     total = hlen + len;
     hdr->total = hton16(total);
     hdr->id = hton16(id);
-    hdr->offset = hton16(offset);
+    /* datagrams that are not fragmented are used to probe the path MTU */
+    hdr->offset = (total <= mtu || gso) ? hton16(IP_HDR_FLAG_DF) : 0;
     hdr->ttl = 0xff;
     hdr->protocol = protocol;
     hdr->sum = 0;
@@ -390,65 +1644,174 @@ ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, si
     hdr->dst = dst;
     hdr->sum = cksum16((uint16_t *)hdr, hlen, 0); /* don't convert bytoder */
     memcpy(hdr+1, data, len);
-    debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
-        NET_IFACE(iface)->dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(protocol), protocol, total);
+    debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u, mtu=%u",
+        NET_IFACE(iface)->dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(protocol), protocol, total, mtu);
     ip_dump(buf, total);
-    return ip_output_device(iface, buf, total, nexthop);
+    if (total <= mtu) {
+        return ip_output_device(iface, buf, total, nexthop, cache);
+    }
+    if (gso) {
+        return ip_output_gso(iface, buf, total, nexthop, mtu, gso, cache);
+    }
+    return ip_output_fragment(iface, buf, total, nexthop, mtu, cache);
 }
 
+/* NOTE: reserves num consecutive ids and returns the first one, a super-segment takes one id per segment */
 static uint16_t
-ip_generate_id(void)
+ip_generate_id_range(uint16_t num)
 {
     static mutex_t mutex = MUTEX_INITIALIZER;
     static uint16_t id = 128;
     uint16_t ret;
 
     mutex_lock(&mutex);
-    ret = id++;
+    ret = id;
+    id += num;
     mutex_unlock(&mutex);
     return ret;
 }
 
-ssize_t
-ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
+/* NOTE: the number of the datagrams ip_output_core() sends with its own id, the IP header has no options */
+static uint16_t
+ip_output_id_num(size_t len, uint16_t mtu, const struct ip_gso *gso)
+{
+    size_t max;
+
+    if (!gso || IP_HDR_SIZE_MIN + len <= mtu || mtu <= IP_HDR_SIZE_MIN + gso->hlen || len <= gso->hlen) {
+        return 1;
+    }
+    max = mtu - (IP_HDR_SIZE_MIN + gso->hlen);
+    return (len - gso->hlen + max - 1) / max;
+}
+
+/*
+ * Destination Cache
+ *
+ * NOTE: a cache holds the result of the route lookup, the path MTU and the ARP resolution
+ *       for a destination. It is valid while the generation has not changed, and the
+ *       generation is bumped on any change of the routes, path MTUs and ARP caches.
+ */
+
+void
+ip_dst_cache_invalidate(void)
+{
+    if (!__atomic_add_fetch(&dst_cache_gen, 1, __ATOMIC_RELEASE)) {
+        __atomic_add_fetch(&dst_cache_gen, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static int
+ip_dst_cache_valid(struct ip_dst_cache *cache, ip_addr_t src, ip_addr_t dst)
+{
+    return cache->gen == __atomic_load_n(&dst_cache_gen, __ATOMIC_ACQUIRE) && cache->dst == dst && cache->src == src;
+}
+
+/*
+ * NOTE: hash is used to select a path of the multipath route. the caller takes the generation
+ *       before the lookup so that the changes during the lookup invalidate the cache.
+ */
+static int
+ip_dst_cache_fill(struct ip_dst_cache *cache, ip_addr_t src, ip_addr_t dst, uint32_t hash)
 {
     struct ip_route *route;
-    struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
-    ip_addr_t nexthop;
-    uint16_t id;
 
-    if (src == IP_ADDR_ANY && dst == IP_ADDR_BROADCAST) {
-        errorf("source address is required for broadcast addresses");
-        return -1;
-    }
+    cache->gen = 0;
+    cache->resolved = 0;
     route = ip_route_lookup(dst);
     if (!route) {
         errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
         return -1;
     }
-    iface = route->iface;
-    if (src != IP_ADDR_ANY && src != iface->unicast) {
+    route = ip_route_select(route, src, hash);
+    if (!route) {
         errorf("unable to output with specified source address, addr=%s", ip_addr_ntop(src, addr, sizeof(addr)));
         return -1;
     }
-    nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : dst;
-    if (NET_IFACE(iface)->dev->mtu < IP_HDR_SIZE_MIN + len) {
-        errorf("too long, dev=%s, mtu=%s, tatal=%zu",
-            NET_IFACE(iface)->dev->name, NET_IFACE(iface)->dev->mtu, IP_HDR_SIZE_MIN + len);
+    cache->src = src;
+    cache->dst = dst;
+    cache->iface = route->iface;
+    cache->nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : dst;
+    cache->mtu = ip_pmtu_lookup(dst, NET_IFACE(route->iface)->dev->mtu);
+    return 0;
+}
+
+/*
+ * NOTE: returns the path MTU to the foreign address with revalidating the cache, or 0 if there is no route.
+ *       the flow hash is the same as the one ip_output_cached() takes from the datagrams of the flow,
+ *       so the refills keep the flow on the same path of the multipath route.
+ */
+uint16_t
+ip_dst_cache_mtu(struct ip_dst_cache *cache, uint8_t protocol, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    uint32_t gen;
+
+    if (!ip_dst_cache_valid(cache, local->addr, foreign->addr)) {
+        gen = __atomic_load_n(&dst_cache_gen, __ATOMIC_ACQUIRE);
+        if (ip_dst_cache_fill(cache, local->addr, foreign->addr, ip_route_flow_hash(protocol, foreign->addr, local->port, foreign->port)) == -1) {
+            return 0;
+        }
+        cache->gen = gen;
+    }
+    return cache->mtu;
+}
+
+/*
+ * NOTE: same as ip_output() but the route, the path MTU and the hardware address are
+ *       taken from the cache while it is valid. The caller must serialize the calls for the same cache.
+ * NOTE: if gso is given, data is a super-segment of the transport protocol that is split
+ *       into segments at the device step instead of IP fragments.
+ * NOTE: returns NET_DEVICE_OUTPUT_FULL if the device queue is full, the datagram (or the rest of it) is not sent.
+ */
+ssize_t
+ip_output_cached(struct ip_dst_cache *cache, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, const struct ip_gso *gso)
+{
+    uint32_t gen;
+    ssize_t ret;
+    char addr[IP_ADDR_STR_LEN];
+
+    if (src == IP_ADDR_ANY && dst == IP_ADDR_BROADCAST) {
+        errorf("source address is required for broadcast addresses");
+        return -1;
+    }
+    if (!ip_dst_cache_valid(cache, src, dst)) {
+        gen = __atomic_load_n(&dst_cache_gen, __ATOMIC_ACQUIRE);
+        if (ip_dst_cache_fill(cache, src, dst, ip_route_flow_hash_payload(protocol, dst, data, len)) == -1) {
+            return -1;
+        }
+        cache->gen = gen;
+    }
+    if (len > IP_PAYLOAD_SIZE_MAX) {
+        errorf("too long, len=%zu", len);
+        return -1;
+    }
+    if (acl_filter(ACL_DIR_OUT, protocol, cache->iface->unicast, dst, data, len) == ACL_ACTION_DROP) {
+        errorf("denied by the filter, dst=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
         return -1;
     }
-    id = ip_generate_id();
-    if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, id, 0) == -1) {
+    ret = ip_output_core(cache->iface, protocol, data, len, cache->iface->unicast, dst, cache->nexthop, cache->tos, ip_generate_id_range(ip_output_id_num(len, cache->mtu, gso)), cache->mtu, gso, cache);
+    if (ret == NET_DEVICE_OUTPUT_FULL) {
+        debugf("device queue is full, dst=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
+        return NET_DEVICE_OUTPUT_FULL;
+    }
+    if (ret == -1) {
         errorf("ip_output_core() failure");
         return -1;
     }
     return len;
 }
 
+ssize_t
+ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
+{
+    struct ip_dst_cache cache = {}; /* never valid, always filled by the lookup */
+
+    return ip_output_cached(&cache, protocol, data, len, src, dst, NULL);
+}
+
 /* NOTE: must not be call after net_run() */
 int
-ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface))
+ip_protocol_register(const char *name, uint8_t type, int (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface))
 {
     struct ip_protocol *entry;
 
@@ -485,12 +1848,25 @@ ip_protocol_name(uint8_t type)
     return "UNKNOWN";
 }
 
+static void
+ip_timer(void)
+{
+    ip_reass_timer();
+    ip_pmtu_timer();
+}
+
 int
 ip_init(void)
 {
+    struct timeval interval = {1, 0};
+
     if (net_protocol_register("IP", NET_PROTOCOL_TYPE_IP, ip_input) == -1) {
         errorf("net_protocol_register() failure");
         return -1;
     }
+    if (net_timer_register("IP Timer", interval, ip_timer) == -1) {
+        errorf("net_timer_register() failure");
+        return -1;
+    }
     return 0;
 }
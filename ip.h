@@ -12,6 +12,10 @@
 #define IP_HDR_SIZE_MIN 20
 #define IP_HDR_SIZE_MAX 60
 
+#define IP_HDR_FLAG_MF 0x2000 /* more fragments flag */
+#define IP_HDR_FLAG_DF 0x4000 /* don't fragment flag */
+#define IP_HDR_OFFSET_MASK 0x1fff
+
 #define IP_TOTAL_SIZE_MAX UINT16_MAX /* maximum value of uint16 */
 #define IP_PAYLOAD_SIZE_MAX (IP_TOTAL_SIZE_MAX - IP_HDR_SIZE_MIN)
 
@@ -25,6 +29,9 @@
 #define IP_PROTOCOL_TCP  0x06
 #define IP_PROTOCOL_UDP  0x11
 
+/* returned by the protocol handlers when no one is listening on the destination port */
+#define IP_PROTOCOL_PORT_UNREACH 1
+
 typedef uint32_t ip_addr_t;
 
 struct ip_endpoint {
@@ -32,14 +39,63 @@ struct ip_endpoint {
     uint16_t port;
 };
 
+struct ip_hdr {
+    uint8_t vhl;
+    uint8_t tos;
+    uint16_t total;
+    uint16_t id;
+    uint16_t offset;
+    uint8_t ttl;
+    uint8_t protocol;
+    uint16_t sum;
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint8_t options[0];
+};
+
 struct ip_iface {
     struct net_iface iface;
     struct ip_iface *next;
+    struct ip_iface *hnext; /* next entry in the same bucket of the local address hash */
     ip_addr_t unicast;
     ip_addr_t netmask;
     ip_addr_t broadcast;
 };
 
+struct ip_reass_stats {
+    unsigned long timeouts; /* datagrams discarded by the reassembly timeout */
+    unsigned long overlaps; /* fragments overlapping the data already received */
+    unsigned long drops; /* datagrams discarded by the memory limit, the size limit or an inconsistent end */
+};
+
+/*
+ * NOTE: destination cache attached to a PCB, zero-cleared state is invalid.
+ *       the fields are managed by ip_output_cached() and ip_dst_cache_mtu() except for tos.
+ */
+struct ip_dst_cache {
+    uint8_t tos; /* set by the owner, kept across the refills */
+    uint32_t gen; /* generation when the cache was filled */
+    ip_addr_t src; /* source address requested by the caller */
+    ip_addr_t dst;
+    struct ip_iface *iface;
+    ip_addr_t nexthop;
+    uint16_t mtu; /* path MTU */
+    int resolved; /* ha is valid */
+    uint8_t ha[NET_DEVICE_ADDR_LEN];
+};
+
+#define IP_GSO_HDR_SIZE_MAX 60 /* maximum transport header length */
+
+/*
+ * NOTE: generic segmentation offload, fixup is called for each segment split from the
+ *       super-segment with the copy of the transport header followed by the payload slice.
+ *       offset is the position of the slice in the payload of the super-segment.
+ */
+struct ip_gso {
+    uint16_t hlen; /* transport header length */
+    void (*fixup)(uint8_t *data, size_t len, size_t offset, int last, ip_addr_t src, ip_addr_t dst);
+};
+
 extern const ip_addr_t IP_ADDR_ANY;
 extern const ip_addr_t IP_ADDR_BROADCAST;
 
@@ -54,8 +110,16 @@ ip_endpoint_ntop(const struct ip_endpoint *n, char *p, size_t size);
 
 extern int
 ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway);
+extern int
+ip_route_add_path(const char *network, const char *netmask, const char *nexthop, struct ip_iface *iface, uint8_t weight);
 extern struct ip_iface *
 ip_route_get_iface(ip_addr_t dst);
+extern struct ip_iface *
+ip_route_get_iface_flow(uint8_t protocol, ip_addr_t dst, uint16_t sport, uint16_t dport);
+extern uint32_t
+ip_route_flow_hash(uint8_t protocol, ip_addr_t dst, uint16_t sport, uint16_t dport);
+extern int
+ip_route_load(const char *path);
 
 extern struct ip_iface *
 ip_iface_alloc(const char *addr, const char *netmask);
@@ -64,11 +128,29 @@ ip_iface_register(struct net_device *dev, struct ip_iface *iface);
 extern struct ip_iface *
 ip_iface_select(ip_addr_t addr);
 
+extern void
+ip_forwarding(int enable);
+
+extern uint16_t
+ip_pmtu(ip_addr_t dst);
+extern void
+ip_pmtu_update(ip_addr_t dst, uint16_t mtu, uint16_t total);
+
+extern void
+ip_reass_stats(struct ip_reass_stats *stats);
+
+extern void
+ip_dst_cache_invalidate(void);
+extern uint16_t
+ip_dst_cache_mtu(struct ip_dst_cache *cache, uint8_t protocol, struct ip_endpoint *local, struct ip_endpoint *foreign);
+extern ssize_t
+ip_output_cached(struct ip_dst_cache *cache, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, const struct ip_gso *gso);
+
 extern ssize_t
 ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
 
 extern int
-ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
+ip_protocol_register(const char *name, uint8_t type, int (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
 extern char *
 ip_protocol_name(uint8_t type);
 
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/time.h>
@@ -11,6 +12,50 @@
 #include "util.h"
 #include "net.h"
 
+/*
+ * NOTE: egress classes of a device keyed on the TOS of IP datagrams, the priority class is
+ *       served first and the others share the rest of the link by deficit round robin.
+ */
+#define NET_TXQ_CLASS_PRIO        0 /* network control and expedited forwarding */
+#define NET_TXQ_CLASS_INTERACTIVE 1
+#define NET_TXQ_CLASS_DEFAULT     2
+#define NET_TXQ_CLASS_BULK        3
+#define NET_TXQ_CLASS_NUM         4
+
+#define NET_TXQ_LEN_MAX 256 /* frames per class */
+#define NET_TXQ_BATCH    32 /* frames flushed at once */
+
+/* see https://www.iana.org/assignments/dscp-registry/dscp-registry.xhtml */
+#define NET_DSCP_LE   1
+#define NET_DSCP_CS1  8
+#define NET_DSCP_CS3 24
+#define NET_DSCP_EF  46
+#define NET_DSCP_CS6 48
+
+struct net_txq_class {
+    struct queue_head queue;
+    unsigned int weight; /* quantum of DRR in units of the MTU */
+    size_t deficit;
+};
+
+struct net_device_txq {
+    mutex_t mutex;
+    int busy; /* a thread is flushing the queued frames */
+    int kicked; /* the interrupt thread is requested to flush */
+    unsigned int num; /* frames in all classes */
+    struct net_txq_class classes[NET_TXQ_CLASS_NUM];
+    int current; /* DRR class in turn */
+    int credited; /* the quantum is given to the current class */
+};
+
+/* NOTE: the data follows immediately after the structure */
+struct net_txq_entry {
+    uint16_t type;
+    size_t len;
+    int has_dst;
+    uint8_t dst[NET_DEVICE_ADDR_LEN];
+};
+
 struct net_protocol {
     struct net_protocol *next;
     char name[16];
@@ -39,11 +84,18 @@ struct net_event {
     void *arg;
 };
 
+struct net_drain {
+    struct net_drain *next;
+    void (*handler)(void *arg);
+    void *arg;
+};
+
 /* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
 static struct net_device *devices;
 static struct net_protocol *protocols;
 static struct net_timer *timers;
 static struct net_event *events;
+static struct net_drain *drains;
 
 struct net_device *
 net_device_alloc(void (*setup)(struct net_device *dev))
@@ -66,7 +118,20 @@ int
 net_device_register(struct net_device *dev)
 {
     static unsigned int index = 0;
+    static const unsigned int weights[NET_TXQ_CLASS_NUM] = {0, 4, 2, 1};
+    int i;
 
+    dev->txq = memory_alloc(sizeof(*dev->txq));
+    if (!dev->txq) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    mutex_init(&dev->txq->mutex);
+    for (i = 0; i < NET_TXQ_CLASS_NUM; i++) {
+        queue_init(&dev->txq->classes[i].queue);
+        dev->txq->classes[i].weight = weights[i];
+    }
+    dev->txq->current = NET_TXQ_CLASS_PRIO + 1;
     dev->index = index++;
     snprintf(dev->name, sizeof(dev->name), "net%d", dev->index);
     dev->next = devices;
@@ -115,17 +180,18 @@ net_device_close(struct net_device *dev)
 int
 net_device_add_iface(struct net_device *dev, struct net_iface *iface)
 {
-    struct net_iface *entry;
+    struct net_iface *entry, **tail;
 
-    for (entry = dev->ifaces; entry; entry = entry->next) {
-        if (entry->family == iface->family) {
+    /* NOTE: a device may have multiple interfaces of the same family, the first one is the primary */
+    for (tail = &dev->ifaces; (entry = *tail); tail = &entry->next) {
+        if (entry == iface) {
             errorf("already exists, dev=%s, family=%d", dev->name, entry->family);
             return -1;
         }
     }
-    iface->next = dev->ifaces;
+    iface->next = NULL;
     iface->dev = dev;
-    dev->ifaces = iface;
+    *tail = iface;
     return 0;
 }
 
@@ -142,9 +208,156 @@ net_device_get_iface(struct net_device *dev, int family)
     return entry;
 }
 
+static int
+net_txq_classify(uint16_t type, const uint8_t *data, size_t len)
+{
+    uint8_t dscp;
+
+    if (type == NET_PROTOCOL_TYPE_ARP) {
+        /* the other traffic waits for the address resolution */
+        return NET_TXQ_CLASS_PRIO;
+    }
+    if (type != NET_PROTOCOL_TYPE_IP || len < 2) {
+        return NET_TXQ_CLASS_DEFAULT;
+    }
+    /* NOTE: the second octet of the IPv4 header is TOS, its upper 6 bits are DSCP (RFC 2474) */
+    dscp = data[1] >> 2;
+    if (dscp == NET_DSCP_EF || dscp >= NET_DSCP_CS6) {
+        return NET_TXQ_CLASS_PRIO;
+    }
+    if (dscp == NET_DSCP_LE || dscp == NET_DSCP_CS1) {
+        return NET_TXQ_CLASS_BULK;
+    }
+    if (dscp >= NET_DSCP_CS3) {
+        return NET_TXQ_CLASS_INTERACTIVE;
+    }
+    return NET_TXQ_CLASS_DEFAULT;
+}
+
+/* NOTE: must be called with the mutex of the queue locked */
+static struct net_txq_entry *
+net_txq_dequeue(struct net_device *dev)
+{
+    struct net_device_txq *txq = dev->txq;
+    struct net_txq_class *class;
+    struct net_txq_entry *entry;
+
+    if (!txq->num) {
+        return NULL;
+    }
+    txq->num--;
+    entry = queue_pop(&txq->classes[NET_TXQ_CLASS_PRIO].queue);
+    if (entry) {
+        return entry;
+    }
+    /* NOTE: terminates because at least one class has a frame and every quantum covers the MTU */
+    while (1) {
+        class = &txq->classes[txq->current];
+        if (!txq->credited) {
+            class->deficit += class->weight * dev->mtu;
+            txq->credited = 1;
+        }
+        entry = queue_peek(&class->queue);
+        if (entry && entry->len <= class->deficit) {
+            class->deficit -= entry->len;
+            return queue_pop(&class->queue);
+        }
+        if (!entry) {
+            /* an idle class does not save up the quantum */
+            class->deficit = 0;
+        }
+        txq->current = (txq->current < NET_TXQ_CLASS_NUM - 1) ? txq->current + 1 : NET_TXQ_CLASS_PRIO + 1;
+        txq->credited = 0;
+    }
+}
+
+/* NOTE: the frames are handed to the driver at once if it supports the batched transmission */
+static int
+net_device_transmit(struct net_device *dev, struct net_txq_entry **entries, int num)
+{
+    struct net_device_frame frames[NET_TXQ_BATCH];
+    int i, ret;
+
+    if (!dev->ops->transmit_batch) {
+        ret = 0;
+        for (i = 0; i < num; i++) {
+            if (dev->ops->transmit(dev, entries[i]->type, (uint8_t *)(entries[i]+1), entries[i]->len, entries[i]->has_dst ? entries[i]->dst : NULL) == -1) {
+                errorf("device transmit failure, dev=%s, len=%zu", dev->name, entries[i]->len);
+                ret = -1;
+            }
+        }
+        return ret;
+    }
+    for (i = 0; i < num; i++) {
+        frames[i].type = entries[i]->type;
+        frames[i].data = (uint8_t *)(entries[i]+1);
+        frames[i].len = entries[i]->len;
+        frames[i].dst = entries[i]->has_dst ? entries[i]->dst : NULL;
+    }
+    ret = dev->ops->transmit_batch(dev, frames, num);
+    if (ret < num) {
+        errorf("device transmit failure, dev=%s, sent=%d, num=%d", dev->name, ret == -1 ? 0 : ret, num);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * NOTE: transmits the queued frames in the order of the scheduler. the frames are taken
+ *       out by batches so that the mutex is not held while the driver is writing them.
+ */
+static int
+net_device_flush(struct net_device *dev)
+{
+    struct net_device_txq *txq = dev->txq;
+    struct net_txq_entry *batch[NET_TXQ_BATCH];
+    int num, i, ret = 0;
+
+    mutex_lock(&txq->mutex);
+    if (txq->busy) {
+        /* the other thread is flushing, it sends the frames queued meanwhile too */
+        mutex_unlock(&txq->mutex);
+        return 0;
+    }
+    txq->busy = 1;
+    txq->kicked = 0;
+    while (1) {
+        for (num = 0; num < NET_TXQ_BATCH; num++) {
+            batch[num] = net_txq_dequeue(dev);
+            if (!batch[num]) {
+                break;
+            }
+        }
+        if (!num) {
+            break;
+        }
+        mutex_unlock(&txq->mutex);
+        if (net_device_transmit(dev, batch, num) == -1) {
+            ret = -1;
+        }
+        for (i = 0; i < num; i++) {
+            memory_free(batch[i]);
+        }
+        mutex_lock(&txq->mutex);
+    }
+    txq->busy = 0;
+    mutex_unlock(&txq->mutex);
+    return ret;
+}
+
+/*
+ * NOTE: the frame is queued and the caller returns without writing it to the device.
+ *       the queue is flushed by the interrupt thread, or by the caller once a batch is full.
+ *       if the class of the frame is full, returns NET_DEVICE_OUTPUT_FULL (with errno set to EAGAIN
+ *       for the socket API) so that the callers can tell it from the other failures.
+ */
 int
 net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
 {
+    struct net_device_txq *txq = dev->txq;
+    struct net_txq_entry *entry;
+    int class, kick = 0, flush = 0;
+
     if (!NET_DEVICE_IS_UP(dev)) {
         errorf("not opened, dev=%s", dev->name);
         return -1;
@@ -155,10 +368,50 @@ net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, si
     }
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
     debugdump(data, len);
-    if (dev->ops->transmit(dev, type, data, len, dst) == -1) {
-        errorf("device transmit failure, dev=%s, len=%zu", dev->name, len);
+    entry = memory_alloc(sizeof(*entry) + len);
+    if (!entry) {
+        errorf("memory_alloc() failure");
         return -1;
     }
+    entry->type = type;
+    entry->len = len;
+    if (dst) {
+        entry->has_dst = 1;
+        memcpy(entry->dst, dst, dev->alen);
+    }
+    memcpy(entry+1, data, len);
+    class = net_txq_classify(type, data, len);
+    mutex_lock(&txq->mutex);
+    if (txq->classes[class].queue.num >= NET_TXQ_LEN_MAX) {
+        mutex_unlock(&txq->mutex);
+        debugf("queue is full, dev=%s, class=%d", dev->name, class);
+        memory_free(entry);
+        errno = EAGAIN;
+        return NET_DEVICE_OUTPUT_FULL;
+    }
+    if (!queue_push(&txq->classes[class].queue, entry)) {
+        mutex_unlock(&txq->mutex);
+        errorf("queue_push() failure");
+        memory_free(entry);
+        return -1;
+    }
+    txq->num++;
+    /* NOTE: while the other thread is flushing, the frame is sent by that thread */
+    if (!txq->busy) {
+        if (txq->num >= NET_TXQ_BATCH) {
+            flush = 1;
+        } else if (!txq->kicked) {
+            txq->kicked = 1;
+            kick = 1;
+        }
+    }
+    mutex_unlock(&txq->mutex);
+    if (flush) {
+        return net_device_flush(dev);
+    }
+    if (kick) {
+        raise_softirq();
+    }
     return 0;
 }
 
@@ -238,6 +491,8 @@ net_protocol_handler(void)
     struct net_protocol *proto;
     struct net_protocol_queue_entry *entry;
     unsigned int num;
+    struct net_drain *drain;
+    struct net_device *dev;
 
     for (proto = protocols; proto; proto = proto->next) {
         while (1) {
@@ -252,6 +507,38 @@ net_protocol_handler(void)
             free(entry);
         }
     }
+    /* the end of the batch: let the protocols flush what they held during the batch */
+    for (drain = drains; drain; drain = drain->next) {
+        drain->handler(drain->arg);
+    }
+    /* the frames sent by the handlers above and the ones queued by the user threads */
+    for (dev = devices; dev; dev = dev->next) {
+        if (NET_DEVICE_IS_UP(dev)) {
+            net_device_flush(dev);
+        }
+    }
+    return 0;
+}
+
+/*
+ * NOTE: the handler is called in the same context as the protocol handlers
+ *       each time the input queues have been drained.
+ * NOTE: must not be call after net_run()
+ */
+int
+net_drain_subscribe(void (*handler)(void *arg), void *arg)
+{
+    struct net_drain *drain;
+
+    drain = memory_alloc(sizeof(*drain));
+    if (!drain) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    drain->handler = handler;
+    drain->arg = arg;
+    drain->next = drains;
+    drains = drain;
     return 0;
 }
 
@@ -329,6 +616,13 @@ net_event_handler(void)
     return 0;
 }
 
+#include "arp.h"
+#include "ip.h"
+#include "icmp.h"
+#include "port.h"
+#include "udp.h"
+#include "tcp.h"
+
 int
 net_run(void)
 {
@@ -353,17 +647,13 @@ net_shutdown(void)
 
     debugf("close all devices...");
     for (dev = devices; dev; dev = dev->next) {
+        net_device_flush(dev);
         net_device_close(dev);
     }
+    arp_shutdown();
     debugf("shutdown");
 }
 
-#include "arp.h"
-#include "ip.h"
-#include "icmp.h"
-#include "udp.h"
-#include "tcp.h"
-
 int
 net_init(void)
 {
@@ -383,6 +673,10 @@ net_init(void)
         errorf("icmp_init() failure");
         return -1;
     }
+    if (port_init() == -1) {
+        errorf("port_init() failure");
+        return -1;
+    }
     if (udp_init() == -1) {
         errorf("udp_init() failure");
         return -1;
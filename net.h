@@ -37,7 +37,10 @@
 
 #define NET_IRQ_SHARED 0x0001
 
+#define NET_DEVICE_OUTPUT_FULL -2 /* net_device_output(): the queue is full and the frame is not queued */
+
 struct net_device; /* forward declaration */
+struct net_device_txq; /* NOTE: egress scheduler, private to net.c */
 
 struct net_iface {
     struct net_iface *next;
@@ -46,10 +49,18 @@ struct net_iface {
     /* depends on implementation of protocols. */
 };
 
+struct net_device_frame {
+    uint16_t type;
+    const uint8_t *data;
+    size_t len;
+    const void *dst;
+};
+
 struct net_device_ops {
     int (*open)(struct net_device *dev);
     int (*close)(struct net_device *dev);
     int (*transmit)(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+    int (*transmit_batch)(struct net_device *dev, const struct net_device_frame *frames, size_t num); /* optional, returns the number of the frames sent */
     int (*poll)(struct net_device *dev);
 };
 
@@ -69,6 +80,7 @@ struct net_device {
         uint8_t broadcast[NET_DEVICE_ADDR_LEN];
     };
     struct net_device_ops *ops;
+    struct net_device_txq *txq;
     void *priv;
 };
 
@@ -92,6 +104,8 @@ extern char *
 net_protocol_name(uint16_t type);
 extern int
 net_protocol_handler(void);
+extern int
+net_drain_subscribe(void (*handler)(void *arg), void *arg);
 
 extern int
 net_timer_register(const char *name, struct timeval interval, void (*handler)(void));
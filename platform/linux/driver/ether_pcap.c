@@ -1,4 +1,4 @@
-#define _GNU_SOURCE /* for F_SETSIG */
+#define _GNU_SOURCE /* for F_SETSIG and sendmmsg() */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -140,6 +140,31 @@ ether_pcap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, s
     return ether_transmit_helper(dev, type, buf, len, dst, ether_pcap_write);
 }
 
+/* NOTE: the socket is bound to the interface, the frames are sent by one system call */
+static int
+ether_pcap_write_batch(struct net_device *dev, const struct iovec *frames, size_t num)
+{
+    struct mmsghdr msgs[ETHER_TRANSMIT_BATCH_MAX] = {};
+    size_t i;
+    int ret;
+
+    for (i = 0; i < num; i++) {
+        msgs[i].msg_hdr.msg_iov = (struct iovec *)&frames[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    ret = sendmmsg(PRIV(dev)->fd, msgs, num, 0);
+    if (ret == -1) {
+        errorf("sendmmsg: %s, dev=%s", strerror(errno), dev->name);
+    }
+    return ret;
+}
+
+static int
+ether_pcap_transmit_batch(struct net_device *dev, const struct net_device_frame *frames, size_t num)
+{
+    return ether_transmit_batch_helper(dev, frames, num, ether_pcap_write_batch);
+}
+
 static ssize_t
 ether_pcap_read(struct net_device *dev, uint8_t *buf, size_t size)
 {
@@ -185,6 +210,7 @@ static struct net_device_ops ether_pcap_ops = {
     .open = ether_pcap_open,
     .close = ether_pcap_close,
     .transmit = ether_pcap_transmit,
+    .transmit_batch = ether_pcap_transmit_batch,
 };
 
 struct net_device *
@@ -165,7 +165,7 @@ ether_tap_isr(unsigned int irq, void *id)
 static struct net_device_ops ether_tap_ops = {
     .open = ether_tap_open,
     .close = ether_tap_close,
-    .transmit = ether_tap_transmit,
+    .transmit = ether_tap_transmit, /* NOTE: no transmit_batch, a write to the TAP device carries exactly one frame */
 };
 
 struct net_device *
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "ip.h"
+#include "port.h"
+
+/*
+ * Ephemeral port allocator (RFC 6056)
+ *
+ * each (protocol, local address) has its own space of the ephemeral ports. a port taken by
+ * the allocator is marked in the bitmap of the space and counted, the caller tells whether a
+ * candidate is used by someone else (e.g. bound explicitly) with the callback.
+ *
+ * without the foreign endpoint (UDP), a port is never shared: the search starts at a random
+ * offset and only looks at the clear bits of the bitmap, 64 ports at a time.
+ *
+ * with the foreign endpoint (TCP), the double-hash port selection (Algorithm 4) is used. the
+ * search starts at an offset derived from the 4-tuple, so a port in use towards one destination
+ * is reused towards the others, and the callback checks the 4-tuple.
+ *
+ * a space is created by the first allocation on the (protocol, local address) and freed when its
+ * last port is released, so the number of the addresses in use is not limited. the state of the
+ * search (the perturbation table and the counter) is shared by all the spaces and outlives them,
+ * otherwise a freed space would start over from the same port.
+ *
+ * NOTE: the keyed hash is a 32-bit mixing function instead of MD5, it is enough to make
+ *       the ports unpredictable to an off-path attacker that does not know the secret.
+ */
+
+#define PORT_EPHEMERAL_NUM (PORT_EPHEMERAL_MAX - PORT_EPHEMERAL_MIN + 1)
+#define PORT_BITMAP_WORDS (PORT_EPHEMERAL_NUM / 64)
+
+#define PORT_SPACE_HASH_SIZE 64 /* buckets of the (protocol, local address) hash, must be a power of 2 */
+#define PORT_TABLE_SIZE 256 /* perturbation table of the double-hash port selection */
+
+struct port_space {
+    struct port_space *next; /* next space in the same hash bucket */
+    uint8_t protocol;
+    ip_addr_t addr;
+    uint64_t bitmap[PORT_BITMAP_WORDS]; /* ports taken by at least one user */
+    uint16_t refs[PORT_EPHEMERAL_NUM]; /* users of the port, TCP shares it among the foreign endpoints */
+    uint32_t used; /* ports taken, the space is freed when it drops to 0 */
+};
+
+static mutex_t mutex = MUTEX_INITIALIZER;
+static struct port_space *spaces[PORT_SPACE_HASH_SIZE];
+static uint32_t secret[2];
+static uint16_t table[PORT_TABLE_SIZE]; /* the hash of the index includes the protocol and the local address */
+static uint32_t count; /* number of the searches without the foreign endpoint */
+
+static uint32_t
+port_hash(uint32_t a, uint32_t b, uint32_t c, uint32_t key)
+{
+    uint32_t h;
+
+    h = key ^ a;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h ^= b;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    h ^= c;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static struct port_space **
+port_space_bucket(uint8_t protocol, ip_addr_t addr)
+{
+    return &spaces[port_hash(addr, protocol, 0, 0) & (PORT_SPACE_HASH_SIZE - 1)];
+}
+
+/* NOTE: must be called with mutex locked */
+static struct port_space *
+port_space_get(uint8_t protocol, ip_addr_t addr, int create)
+{
+    struct port_space **bucket, *space;
+
+    bucket = port_space_bucket(protocol, addr);
+    for (space = *bucket; space; space = space->next) {
+        if (space->protocol == protocol && space->addr == addr) {
+            return space;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    space = memory_alloc(sizeof(*space));
+    if (!space) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    space->protocol = protocol;
+    space->addr = addr;
+    space->next = *bucket;
+    *bucket = space;
+    return space;
+}
+
+/* NOTE: must be called with mutex locked */
+static void
+port_space_free(struct port_space *space)
+{
+    struct port_space **entry;
+
+    for (entry = port_space_bucket(space->protocol, space->addr); *entry; entry = &(*entry)->next) {
+        if (*entry == space) {
+            *entry = space->next;
+            memory_free(space);
+            return;
+        }
+    }
+}
+
+/* NOTE: must be called with mutex locked */
+static uint16_t
+port_space_take(struct port_space *space, uint32_t n)
+{
+    if (!space->refs[n]++) {
+        space->bitmap[n / 64] |= (uint64_t)1 << (n % 64);
+        space->used++;
+    }
+    return hton16(PORT_EPHEMERAL_MIN + n);
+}
+
+/*
+ * NOTE: returns the port in network byte order, or 0 if all the ports are in use.
+ *       the callback is called with the caller's locks held, it must not call back the allocator.
+ */
+uint16_t
+port_alloc(uint8_t protocol, ip_addr_t addr, struct ip_endpoint *foreign, int (*used)(ip_addr_t addr, uint16_t port, struct ip_endpoint *foreign))
+{
+    struct port_space *space;
+    uint32_t start, n, i, w;
+    uint16_t *perturb, port;
+    uint64_t bits;
+
+    mutex_lock(&mutex);
+    space = port_space_get(protocol, addr, 1);
+    if (!space) {
+        mutex_unlock(&mutex);
+        return 0;
+    }
+    if (foreign) {
+        start = port_hash(addr, foreign->addr, (uint32_t)protocol << 16 | foreign->port, secret[0]);
+        perturb = &table[port_hash(addr, foreign->addr, (uint32_t)protocol << 16 | foreign->port, secret[1]) % PORT_TABLE_SIZE];
+        start += *perturb;
+        for (i = 0; i < PORT_EPHEMERAL_NUM; i++) {
+            n = (start + i) % PORT_EPHEMERAL_NUM;
+            if (!used(addr, hton16(PORT_EPHEMERAL_MIN + n), foreign)) {
+                *perturb += i + 1;
+                port = port_space_take(space, n);
+                mutex_unlock(&mutex);
+                return port;
+            }
+        }
+    } else {
+        start = port_hash(addr, protocol, count++, secret[0]) % PORT_EPHEMERAL_NUM;
+        /* the word of the start offset is visited twice, for the bits above and below the offset */
+        for (i = 0; i <= PORT_BITMAP_WORDS; i++) {
+            w = (start / 64 + i) % PORT_BITMAP_WORDS;
+            bits = ~space->bitmap[w];
+            if (i == 0) {
+                bits &= ~(uint64_t)0 << (start % 64);
+            } else if (i == PORT_BITMAP_WORDS) {
+                bits &= ((uint64_t)1 << (start % 64)) - 1;
+            }
+            while (bits) {
+                n = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if (!used(addr, hton16(PORT_EPHEMERAL_MIN + n), NULL)) {
+                    port = port_space_take(space, n);
+                    mutex_unlock(&mutex);
+                    return port;
+                }
+            }
+        }
+    }
+    if (!space->used) {
+        port_space_free(space);
+    }
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+void
+port_release(uint8_t protocol, ip_addr_t addr, uint16_t port)
+{
+    struct port_space *space;
+    uint32_t n;
+
+    n = ntoh16(port) - PORT_EPHEMERAL_MIN;
+    if (n >= PORT_EPHEMERAL_NUM) {
+        return;
+    }
+    mutex_lock(&mutex);
+    space = port_space_get(protocol, addr, 0);
+    if (space && space->refs[n] && !--space->refs[n]) {
+        space->bitmap[n / 64] &= ~((uint64_t)1 << (n % 64));
+        if (!--space->used) {
+            port_space_free(space);
+        }
+    }
+    mutex_unlock(&mutex);
+}
+
+int
+port_init(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    secret[0] = port_hash(now.tv_sec, now.tv_usec, getpid(), random());
+    secret[1] = port_hash(now.tv_usec, now.tv_sec, getpid(), random());
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef PORT_H
+#define PORT_H
+
+#include <stdint.h>
+
+#include "ip.h"
+
+/* see https://tools.ietf.org/html/rfc6335 */
+#define PORT_EPHEMERAL_MIN 49152
+#define PORT_EPHEMERAL_MAX 65535
+
+extern uint16_t
+port_alloc(uint8_t protocol, ip_addr_t addr, struct ip_endpoint *foreign, int (*used)(ip_addr_t addr, uint16_t port, struct ip_endpoint *foreign));
+extern void
+port_release(uint8_t protocol, ip_addr_t addr, uint16_t port);
+extern int
+port_init(void);
+
+#endif
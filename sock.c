@@ -1,6 +1,9 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
+
+#include "platform.h"
 
 #include "util.h"
 #include "net.h"
@@ -10,7 +13,14 @@
 
 #include "sock.h"
 
-static struct sock socks[128];
+#define SOCK_CHUNK_SIZE 256 /* socks allocated at once when the pool runs out */
+#define SOCK_CHUNK_MAX  256 /* up to 65536 socks, as many as the UDP PCBs */
+
+static mutex_t mutex = MUTEX_INITIALIZER;
+/* NOTE: socks never move once allocated, the ids index the chunks */
+static struct sock *chunks[SOCK_CHUNK_MAX];
+static size_t chunk_num;
+static struct sock *free_socks;
 
 int
 sockaddr_pton(const char *p, struct sockaddr *n, size_t size)
@@ -46,35 +56,81 @@ sockaddr_ntop(const struct sockaddr *n, char *p, size_t size)
     return NULL;
 }
 
+/* NOTE: the ids of the new socks follow the existing ones, the pool never shrinks */
+static int
+sock_grow(void)
+{
+    struct sock *chunk;
+    int i;
+
+    if (chunk_num == SOCK_CHUNK_MAX) {
+        errorf("too many socks");
+        return -1;
+    }
+    chunk = memory_alloc(sizeof(*chunk) * SOCK_CHUNK_SIZE);
+    if (!chunk) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    for (i = SOCK_CHUNK_SIZE - 1; i >= 0; i--) {
+        chunk[i].id = chunk_num * SOCK_CHUNK_SIZE + i;
+        chunk[i].next = free_socks;
+        free_socks = &chunk[i];
+    }
+    chunks[chunk_num++] = chunk;
+    debugf("grown, num=%zu", chunk_num * SOCK_CHUNK_SIZE);
+    return 0;
+}
+
 static struct sock *
 sock_alloc(void)
 {
     struct sock *entry;
 
-    for (entry = socks; entry < tailof(socks); entry++) {
-        if (!entry->used) {
-            entry->used = 1;
-            return entry;
-        }
+    mutex_lock(&mutex);
+    if (!free_socks && sock_grow() == -1) {
+        mutex_unlock(&mutex);
+        return NULL;
     }
-    return NULL;
+    entry = free_socks;
+    free_socks = entry->next;
+    entry->next = NULL;
+    entry->used = 1;
+    mutex_unlock(&mutex);
+    return entry;
 }
 
 static int
 sock_free(struct sock *s)
 {
-    memset(s, 0, sizeof(*s));
+    mutex_lock(&mutex);
+    s->used = 0;
+    s->family = 0;
+    s->type = 0;
+    s->desc = 0;
+    s->next = free_socks;
+    free_socks = s;
+    mutex_unlock(&mutex);
     return 0;
 }
 
 static struct sock *
 sock_get(int id)
 {
-    if (id < 0 || id >= (int)countof(socks)) {
+    struct sock *s;
+
+    mutex_lock(&mutex);
+    if (id < 0 || id >= (int)(chunk_num * SOCK_CHUNK_SIZE)) {
         /* out of range */
+        mutex_unlock(&mutex);
+        return NULL;
+    }
+    s = &chunks[id / SOCK_CHUNK_SIZE][id % SOCK_CHUNK_SIZE];
+    mutex_unlock(&mutex);
+    if (!s->used) {
         return NULL;
     }
-    return &socks[id];
+    return s;
 }
 
 int
@@ -106,9 +162,10 @@ sock_open(int domain, int type, int protocol)
         break;
     }
     if (s->desc == -1) {
+        sock_free(s);
         return -1;
     }
-    return indexof(socks, s);
+    return s->id;
 }
 
 int
@@ -181,6 +238,92 @@ sock_sendto(int id, const void *buf, size_t n, const struct sockaddr *addr, int
     return -1;
 }
 
+int
+sock_recvmmsg(int id, struct sock_mmsg *msgs, unsigned int vlen, int flags)
+{
+    struct sock *s;
+    struct udp_msg m[UDP_MMSG_MAX];
+    int ret, i;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->type != SOCK_DGRAM) {
+        return -1;
+    }
+    if (flags & ~MSG_DONTWAIT) {
+        return -1;
+    }
+    vlen = MIN(vlen, UDP_MMSG_MAX);
+    switch (s->family) {
+    case AF_INET:
+        for (i = 0; i < (int)vlen; i++) {
+            if (msgs[i].addr && msgs[i].addrlen < (int)sizeof(struct sockaddr_in)) {
+                return -1;
+            }
+            m[i].buf = msgs[i].buf;
+            m[i].size = msgs[i].n;
+        }
+        ret = udp_recvmmsg(s->desc, m, vlen, (flags & MSG_DONTWAIT) ? UDP_MSG_DONTWAIT : 0);
+        for (i = 0; i < ret; i++) {
+            msgs[i].len = m[i].len;
+            if (msgs[i].addr) {
+                msgs[i].addrlen = sizeof(struct sockaddr_in);
+                ((struct sockaddr_in *)msgs[i].addr)->sin_family = s->family;
+                ((struct sockaddr_in *)msgs[i].addr)->sin_addr = m[i].foreign.addr;
+                ((struct sockaddr_in *)msgs[i].addr)->sin_port = m[i].foreign.port;
+            }
+        }
+        return ret;
+    }
+    return -1;
+}
+
+int
+sock_sendmmsg(int id, struct sock_mmsg *msgs, unsigned int vlen, int flags)
+{
+    struct sock *s;
+    struct udp_msg m[UDP_MMSG_MAX];
+    int ret, i;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->type != SOCK_DGRAM) {
+        return -1;
+    }
+    if (flags & ~MSG_DONTWAIT) {
+        return -1;
+    }
+    vlen = MIN(vlen, UDP_MMSG_MAX);
+    switch (s->family) {
+    case AF_INET:
+        for (i = 0; i < (int)vlen; i++) {
+            if (msgs[i].addr) {
+                if (msgs[i].addrlen < (int)sizeof(struct sockaddr_in)) {
+                    return -1;
+                }
+                m[i].foreign.addr = ((struct sockaddr_in *)msgs[i].addr)->sin_addr;
+                m[i].foreign.port = ((struct sockaddr_in *)msgs[i].addr)->sin_port;
+            } else {
+                /* to the connected endpoint */
+                m[i].foreign.addr = IP_ADDR_ANY;
+                m[i].foreign.port = 0;
+            }
+            m[i].buf = msgs[i].buf;
+            m[i].size = m[i].len = msgs[i].n;
+        }
+        ret = udp_sendmmsg(s->desc, m, vlen, (flags & MSG_DONTWAIT) ? UDP_MSG_DONTWAIT : 0);
+        for (i = 0; i < ret; i++) {
+            msgs[i].len = m[i].len;
+        }
+        return ret;
+    }
+    return -1;
+}
+
 int
 sock_bind(int id, const struct sockaddr *addr, int addrlen)
 {
@@ -255,10 +398,14 @@ sock_accept(int id, struct sockaddr *addr, int *addrlen)
         ((struct sockaddr_in *)addr)->sin_addr = ep.addr;
         ((struct sockaddr_in *)addr)->sin_port = ep.port;
         new_s = sock_alloc();
+        if (!new_s) {
+            tcp_close(ret);
+            return -1;
+        }
         new_s->family = s->family;
         new_s->type = s->type;
         new_s->desc = ret;
-        return indexof(socks, new_s);
+        return new_s->id;
     }
     return -1;
 }
@@ -273,14 +420,17 @@ sock_connect(int id, const struct sockaddr *addr, int addrlen)
     if (!s) {
         return -1;
     }
-    if (s->type != SOCK_STREAM) {
-        return -1;
-    }
     switch (s->family) {
     case AF_INET:
         ep.addr = ((struct sockaddr_in *)addr)->sin_addr;
         ep.port = ((struct sockaddr_in *)addr)->sin_port;
-        return tcp_connect(s->desc, &ep);
+        switch (s->type) {
+        case SOCK_STREAM:
+            return tcp_connect(s->desc, &ep);
+        case SOCK_DGRAM:
+            return udp_connect(s->desc, &ep);
+        }
+        return -1;
     }
     return -1;
 }
@@ -294,12 +444,15 @@ sock_recv(int id, void *buf, size_t n)
     if (!s) {
         return -1;
     }
-    if (s->type != SOCK_STREAM) {
-        return -1;
-    }
     switch (s->family) {
     case AF_INET:
-        return tcp_receive(s->desc, (uint8_t *)buf, n);
+        switch (s->type) {
+        case SOCK_STREAM:
+            return tcp_receive(s->desc, (uint8_t *)buf, n);
+        case SOCK_DGRAM:
+            return udp_recvfrom(s->desc, (uint8_t *)buf, n, NULL);
+        }
+        return -1;
     }
     return -1;
 }
@@ -313,12 +466,101 @@ sock_send(int id, const void *buf, size_t n)
     if (!s) {
         return -1;
     }
-    if (s->type != SOCK_STREAM) {
-        return -1;
-    }
     switch (s->family) {
     case AF_INET:
-        return tcp_send(s->desc, (uint8_t *)buf, n);
+        switch (s->type) {
+        case SOCK_STREAM:
+            return tcp_send(s->desc, (uint8_t *)buf, n);
+        case SOCK_DGRAM:
+            return udp_send(s->desc, (uint8_t *)buf, n);
+        }
+        return -1;
+    }
+    return -1;
+}
+
+int
+sock_setsockopt(int id, int level, int optname, const void *optval, int optlen)
+{
+    struct sock *s;
+    int val;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (optlen != sizeof(val)) {
+        return -1;
+    }
+    val = *(const int *)optval;
+    switch (level) {
+    case IPPROTO_IP:
+        if (optname != IP_TOS) {
+            return -1;
+        }
+        if (val < 0 || val > 0xff) {
+            return -1;
+        }
+        switch (s->type) {
+        case SOCK_STREAM:
+            return tcp_set_tos(s->desc, val);
+        case SOCK_DGRAM:
+            return udp_set_tos(s->desc, val);
+        }
+        return -1;
+    case SOL_SOCKET:
+        if (s->type != SOCK_DGRAM) {
+            return -1;
+        }
+        switch (optname) {
+        case SO_RCVBUF:
+            if (val < 0) {
+                return -1;
+            }
+            return udp_set_rcvbuf(s->desc, val);
+        case SO_REUSEPORT:
+            return udp_set_reuseport(s->desc, val);
+        }
+        return -1;
     }
     return -1;
 }
+
+int
+sock_getsockopt(int id, int level, int optname, void *optval, int *optlen)
+{
+    struct sock *s;
+    size_t size;
+    unsigned long drops;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (level != SOL_SOCKET || s->type != SOCK_DGRAM) {
+        return -1;
+    }
+    if (udp_get_rcvbuf(s->desc, &size, &drops) == -1) {
+        return -1;
+    }
+    switch (optname) {
+    case SO_RCVBUF:
+        if (*optlen < (int)sizeof(int)) {
+            return -1;
+        }
+        *(int *)optval = MIN(size, (size_t)INT_MAX);
+        *optlen = sizeof(int);
+        break;
+    case SO_RXQ_OVFL:
+        /* NOTE: a 32-bit counter as on Linux, saturated instead of wrapping around */
+        if (*optlen < (int)sizeof(uint32_t)) {
+            return -1;
+        }
+        *(uint32_t *)optval = MIN(drops, (unsigned long)UINT32_MAX);
+        *optlen = sizeof(uint32_t);
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
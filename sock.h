@@ -19,14 +19,29 @@
 #define SOCK_STREAM 1
 #define SOCK_DGRAM  2
 
+#define IPPROTO_IP  0
 #define IPPROTO_TCP 0
 #define IPPROTO_UDP 0
 
+#define SOL_SOCKET 1
+
+/* level SOL_SOCKET */
+#define SO_RCVBUF    8
+#define SO_REUSEPORT 15 /* must be set before bind */
+#define SO_RXQ_OVFL  40 /* read only, uint32_t, datagrams dropped because the receive buffer was full */
+
+/* level IPPROTO_IP */
+#define IP_TOS 1
+
+#define MSG_DONTWAIT 0x40
+
 #define INADDR_ANY ((ip_addr_t)0)
 
 #define SOCKADDR_STR_LEN IP_ENDPOINT_STR_LEN
 
 struct sock {
+    struct sock *next; /* free list */
+    int id;
     int used;
     int family;
     int type;
@@ -44,6 +59,15 @@ struct sockaddr_in {
     ip_addr_t sin_addr;
 };
 
+/* NOTE: simplified mmsghdr, a message has a single buffer */
+struct sock_mmsg {
+    struct sockaddr *addr; /* destination (NULL for the connected one), or filled with the source (may be NULL) */
+    int addrlen; /* size of addr, set to the length of the source on receive */
+    void *buf;
+    size_t n; /* size of buf, or length of the data to send */
+    size_t len; /* bytes received or sent */
+};
+
 #define IFNAMSIZ 16
 
 extern int
@@ -60,6 +84,10 @@ sock_recvfrom(int id, void *buf, size_t n, struct sockaddr *addr, int *addrlen);
 extern ssize_t
 sock_sendto(int id, const void *buf, size_t n, const struct sockaddr *addr, int addrlen);
 extern int
+sock_recvmmsg(int id, struct sock_mmsg *msgs, unsigned int vlen, int flags);
+extern int
+sock_sendmmsg(int id, struct sock_mmsg *msgs, unsigned int vlen, int flags);
+extern int
 sock_bind(int id, const struct sockaddr *addr, int addrlen);
 extern int
 sock_listen(int id, int backlog);
@@ -71,5 +99,9 @@ extern ssize_t
 sock_recv(int id, void *buf, size_t n);
 extern ssize_t
 sock_send(int id, const void *buf, size_t n);
+extern int
+sock_setsockopt(int id, int level, int optname, const void *optval, int optlen);
+extern int
+sock_getsockopt(int id, int level, int optname, void *optval, int *optlen);
 
 #endif
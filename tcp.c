@@ -10,6 +10,7 @@
 #include "util.h"
 #include "net.h"
 #include "ip.h"
+#include "port.h"
 #include "tcp.h"
 
 #define TCP_FLG_FIN 0x01
@@ -23,6 +24,7 @@
 #define TCP_FLG_ISSET(x, y) ((x & 0x3f) & (y) ? 1 : 0)
 
 #define TCP_PCB_SIZE 16
+#define TCP_PCB_HASH_SIZE 256 /* buckets of the local port hash, must be a power of 2 */
 
 #define TCP_PCB_MODE_RFC793 1
 #define TCP_PCB_MODE_SOCKET 2
@@ -44,8 +46,11 @@
 #define TCP_RETRANSMIT_DEADLINE 12 /* seconds */
 #define TCP_TIMEWAIT_SEC 30 /* substitute for 2MSL */
 
-#define TCP_SOURCE_PORT_MIN 49152
-#define TCP_SOURCE_PORT_MAX 65535
+#define TCP_GRO_SLOT_NUM 8
+#define TCP_GRO_SIZE_MAX 65535 /* payload, limited by tcp_segment_info.len */
+
+#define TCP_SEGMENT_SIZE_MAX (IP_PAYLOAD_SIZE_MAX - sizeof(struct tcp_hdr)) /* super-segment, split by GSO */
+
 
 struct pseudo_hdr {
     uint32_t src;
@@ -78,8 +83,10 @@ struct tcp_segment_info {
 struct tcp_pcb {
     int state;
     int mode; /* user command mode */
+    struct tcp_pcb *next; /* next PCB in the same bucket of the local port hash, while the local port is set */
     struct ip_endpoint local;
     struct ip_endpoint foreign;
+    struct ip_endpoint ephemeral; /* the local port taken from port_alloc() and its space, port is 0 if not */
     struct {
         uint32_t nxt;
         uint32_t una;
@@ -103,6 +110,7 @@ struct tcp_pcb {
     struct timeval tw_timer;
     struct tcp_pcb *parent;
     struct queue_head backlog;
+    struct ip_dst_cache dst; /* protected by the mutex */
 };
 
 struct tcp_queue_entry {
@@ -114,11 +122,24 @@ struct tcp_queue_entry {
     size_t len;
 };
 
+/* NOTE: in-order data segments of a flow merged within one input batch */
+struct tcp_gro_slot {
+    int used;
+    struct ip_endpoint local;
+    struct ip_endpoint foreign;
+    struct tcp_segment_info seg;
+    uint8_t flg;
+    size_t len;
+    uint8_t data[TCP_GRO_SIZE_MAX];
+};
+
 static mutex_t mutex = MUTEX_INITIALIZER;
 static struct tcp_pcb pcbs[TCP_PCB_SIZE];
+static struct tcp_pcb *pcb_hash[TCP_PCB_HASH_SIZE]; /* keyed on the local port only, the address may be a wildcard */
+static struct tcp_gro_slot gro_slots[TCP_GRO_SLOT_NUM]; /* NOTE: accessed only from the input handler */
 
 static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign);
+tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign, struct ip_dst_cache *cache);
 
 static char *
 tcp_flg_ntoa(uint8_t flg)
@@ -163,6 +184,35 @@ tcp_dump(const uint8_t *data, size_t len)
  * NOTE: TCP PCB functions must be called after mutex locked
  */
 
+static struct tcp_pcb **
+tcp_pcb_hash_bucket(uint16_t port)
+{
+    return &pcb_hash[ntoh16(port) & (TCP_PCB_HASH_SIZE - 1)];
+}
+
+/* NOTE: the PCB is in the hash while its local port is not 0 */
+static void
+tcp_pcb_set_local(struct tcp_pcb *pcb, struct ip_endpoint *local)
+{
+    struct tcp_pcb **entry;
+
+    if (pcb->local.port) {
+        for (entry = tcp_pcb_hash_bucket(pcb->local.port); *entry; entry = &(*entry)->next) {
+            if (*entry == pcb) {
+                *entry = pcb->next;
+                break;
+            }
+        }
+        pcb->next = NULL;
+    }
+    pcb->local = *local;
+    if (pcb->local.port) {
+        entry = tcp_pcb_hash_bucket(pcb->local.port);
+        pcb->next = *entry;
+        *entry = pcb;
+    }
+}
+
 static struct tcp_pcb *
 tcp_pcb_alloc(void)
 {
@@ -178,11 +228,21 @@ tcp_pcb_alloc(void)
     return NULL;
 }
 
+static void
+tcp_pcb_release_port(struct tcp_pcb *pcb)
+{
+    if (pcb->ephemeral.port) {
+        port_release(IP_PROTOCOL_TCP, pcb->ephemeral.addr, pcb->ephemeral.port);
+        pcb->ephemeral.port = 0;
+    }
+}
+
 static void
 tcp_pcb_release(struct tcp_pcb *pcb)
 {
     struct queue_entry *entry;
     struct tcp_pcb *est;
+    struct ip_endpoint unbound = {IP_ADDR_ANY, 0};
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
@@ -196,8 +256,10 @@ tcp_pcb_release(struct tcp_pcb *pcb)
     while ((est = queue_pop(&pcb->backlog)) != NULL) {
         tcp_pcb_release(est);
     }
+    tcp_pcb_release_port(pcb);
     debugf("released, local=%s, foreign=%s",
         ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
+    tcp_pcb_set_local(pcb, &unbound);
     memset(pcb, 0, sizeof(*pcb));
 }
 
@@ -206,7 +268,7 @@ tcp_pcb_select(struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
     struct tcp_pcb *pcb, *listen_pcb = NULL;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
+    for (pcb = *tcp_pcb_hash_bucket(local->port); pcb; pcb = pcb->next) {
         if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == local->addr) && pcb->local.port == local->port) {
             if (!foreign) {
                 return pcb;
@@ -225,6 +287,17 @@ tcp_pcb_select(struct ip_endpoint *local, struct ip_endpoint *foreign)
     return listen_pcb;
 }
 
+/* NOTE: called back by port_alloc() with mutex locked */
+static int
+tcp_port_used(ip_addr_t addr, uint16_t port, struct ip_endpoint *foreign)
+{
+    struct ip_endpoint local;
+
+    local.addr = addr;
+    local.port = port;
+    return tcp_pcb_select(&local, foreign) != NULL;
+}
+
 static struct tcp_pcb *
 tcp_pcb_get(int id)
 {
@@ -284,7 +357,8 @@ tcp_retransmit_queue_cleanup(struct tcp_pcb *pcb)
     struct tcp_queue_entry *entry;
 
     while ((entry = queue_peek(&pcb->queue))) {
-        if (entry->seq >= pcb->snd.una) {
+        /* SYN and FIN occupy one sequence number each */
+        if (entry->seq + entry->len + TCP_FLG_ISSET(entry->flg, TCP_FLG_SYN) + TCP_FLG_ISSET(entry->flg, TCP_FLG_FIN) > pcb->snd.una) {
             break;
         }
         entry = queue_pop(&pcb->queue);
@@ -294,6 +368,22 @@ tcp_retransmit_queue_cleanup(struct tcp_pcb *pcb)
     return;
 }
 
+/*
+ * NOTE: the data that has not been acknowledged yet is sent again as one super-segment,
+ *       it is re-segmented by the current path MTU at the device step (RFC 1191).
+ */
+static void
+tcp_retransmit_queue_resend(struct tcp_pcb *pcb, struct tcp_queue_entry *entry)
+{
+    size_t off = 0;
+
+    if (entry->seq < pcb->snd.una) {
+        /* partially acknowledged */
+        off = MIN(pcb->snd.una - entry->seq, entry->len);
+    }
+    tcp_output_segment(entry->seq + off, pcb->rcv.nxt, entry->flg, pcb->rcv.wnd, (uint8_t *)(entry+1) + off, entry->len - off, &pcb->local, &pcb->foreign, &pcb->dst);
+}
+
 static void
 tcp_retransmit_queue_emit(void *arg, void *data)
 {
@@ -313,7 +403,7 @@ tcp_retransmit_queue_emit(void *arg, void *data)
     timeout = entry->last;
     timeval_add_usec(&timeout, entry->rto);
     if (timercmp(&now, &timeout, >)) {
-        tcp_output_segment(entry->seq, pcb->rcv.nxt, entry->flg, pcb->rcv.wnd, (uint8_t *)(entry+1), entry->len, &pcb->local, &pcb->foreign);
+        tcp_retransmit_queue_resend(pcb, entry);
         entry->last = now;
         entry->rto *= 2;
     }
@@ -327,14 +417,44 @@ tcp_set_timewait_timer(struct tcp_pcb *pcb)
     debugf("start time_wait timer: %d seconds", TCP_TIMEWAIT_SEC);
 }
 
+/* NOTE: called for each segment split from the super-segment by GSO */
+static void
+tcp_gso_fixup(uint8_t *data, size_t len, size_t offset, int last, ip_addr_t src, ip_addr_t dst)
+{
+    struct tcp_hdr *hdr;
+    struct pseudo_hdr pseudo;
+    uint16_t psum;
+
+    hdr = (struct tcp_hdr *)data;
+    hdr->seq = hton32(ntoh32(hdr->seq) + offset);
+    if (!last) {
+        /* PSH and FIN belong to the last segment */
+        hdr->flg &= ~(TCP_FLG_PSH | TCP_FLG_FIN);
+    }
+    pseudo.src = src;
+    pseudo.dst = dst;
+    pseudo.zero = 0;
+    pseudo.protocol = IP_PROTOCOL_TCP;
+    pseudo.len = hton16(len);
+    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+    hdr->sum = 0;
+    hdr->sum = cksum16((uint16_t *)hdr, len, psum);
+}
+
+static const struct ip_gso tcp_gso = {
+    .hlen = sizeof(struct tcp_hdr),
+    .fixup = tcp_gso_fixup,
+};
+
 static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign, struct ip_dst_cache *cache)
 {
     uint8_t buf[IP_PAYLOAD_SIZE_MAX] = {};
     struct tcp_hdr *hdr;
     struct pseudo_hdr pseudo;
     uint16_t psum;
     uint16_t total;
+    ssize_t ret;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
@@ -360,8 +480,17 @@ tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_
     debugf("%s => %s, len=%zu (payload=%zu)",
         ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)), total, len);
     tcp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_TCP, (uint8_t *)hdr, total, local->addr, foreign->addr) == -1) {
-        return -1;
+    if (cache) {
+        ret = ip_output_cached(cache, IP_PROTOCOL_TCP, (uint8_t *)hdr, total, local->addr, foreign->addr, &tcp_gso);
+        if (ret < 0) {
+            return ret; /* -1 or NET_DEVICE_OUTPUT_FULL */
+        }
+        return len;
+    }
+    /* NOTE: segments without the cache (e.g. RST) carry no data, no need for GSO */
+    ret = ip_output(IP_PROTOCOL_TCP, (uint8_t *)hdr, total, local->addr, foreign->addr);
+    if (ret < 0) {
+        return ret;
     }
     return len;
 }
@@ -378,7 +507,7 @@ tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len)
     if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN) || len) {
         tcp_retransmit_queue_add(pcb, seq, flg, data, len);
     }
-    return tcp_output_segment(seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign);
+    return tcp_output_segment(seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign, &pcb->dst);
 }
 
 /* rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES] */
@@ -394,9 +523,9 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             return;
         }
         if (!TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, local, foreign);
+            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, local, foreign, NULL);
         } else {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign, NULL);
         }
         return;
     }
@@ -412,7 +541,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
          * second check for an ACK
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign, NULL);
             return;
         }
         /*
@@ -429,9 +558,10 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
                 }
                 new_pcb->mode = TCP_PCB_MODE_SOCKET;
                 new_pcb->parent = pcb;
+                new_pcb->dst.tos = pcb->dst.tos; /* inherited from the listening socket */
                 pcb = new_pcb;
             }
-            pcb->local = *local;
+            tcp_pcb_set_local(pcb, local);
             pcb->foreign = *foreign;
             pcb->rcv.wnd = sizeof(pcb->buf);
             pcb->rcv.nxt = seg->seq + 1;
@@ -456,7 +586,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
             if (seg->ack <= pcb->iss || seg->ack > pcb->snd.nxt) {
-                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign, NULL);
                 return;
             }
             if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt) {
@@ -634,7 +764,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
                 sched_wakeup(&pcb->parent->ctx);
             }
         } else {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign, NULL);
             return;
         }
         /* fall through */
@@ -653,6 +783,8 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
                 pcb->snd.wl1 = seg->seq;
                 pcb->snd.wl2 = seg->ack;
             }
+            /* the send window may have opened for tcp_send() */
+            sched_wakeup(&pcb->ctx);
         } else if (seg->ack < pcb->snd.una) {
             /* ignore */
         } else if (seg->ack > pcb->snd.nxt) {
@@ -768,7 +900,89 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     return;
 }
 
+/*
+ * Generic Receive Offload
+ */
+
 static void
+tcp_gro_flush(struct tcp_gro_slot *slot)
+{
+    debugf("flush, seq=%u, len=%zu", slot->seg.seq, slot->len);
+    mutex_lock(&mutex);
+    tcp_segment_arrives(&slot->seg, slot->flg, slot->data, slot->len, &slot->local, &slot->foreign);
+    mutex_unlock(&mutex);
+    slot->used = 0;
+}
+
+static void
+tcp_gro_drain(void *arg)
+{
+    struct tcp_gro_slot *slot;
+
+    for (slot = gro_slots; slot < tailof(gro_slots); slot++) {
+        if (slot->used) {
+            tcp_gro_flush(slot);
+        }
+    }
+}
+
+static struct tcp_gro_slot *
+tcp_gro_lookup(struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct tcp_gro_slot *slot;
+
+    for (slot = gro_slots; slot < tailof(gro_slots); slot++) {
+        if (slot->used
+            && slot->local.addr == local->addr && slot->local.port == local->port
+            && slot->foreign.addr == foreign->addr && slot->foreign.port == foreign->port) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * NOTE: the segment is held (merged into the slot of the flow if it continues the held data)
+ *       and passed to tcp_segment_arrives() by tcp_gro_flush() at the end of the input batch.
+ */
+static void
+tcp_gro_receive(struct tcp_segment_info *seg, uint8_t flg, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct tcp_gro_slot *slot;
+
+    slot = tcp_gro_lookup(local, foreign);
+    if (slot) {
+        if (slot->seg.seq + slot->len == seg->seq && slot->seg.ack == seg->ack && slot->len + len <= TCP_GRO_SIZE_MAX) {
+            memcpy(slot->data + slot->len, data, len);
+            slot->len += len;
+            slot->seg.len = slot->len;
+            slot->seg.wnd = seg->wnd; /* the latest window */
+            slot->flg |= flg;
+            return;
+        }
+        tcp_gro_flush(slot);
+    } else {
+        for (slot = gro_slots; slot < tailof(gro_slots); slot++) {
+            if (!slot->used) {
+                break;
+            }
+        }
+        if (slot == tailof(gro_slots)) {
+            /* all slots are busy, make room by flushing the first one */
+            slot = gro_slots;
+            tcp_gro_flush(slot);
+        }
+    }
+    slot->used = 1;
+    slot->local = *local;
+    slot->foreign = *foreign;
+    slot->seg = *seg;
+    slot->flg = flg;
+    memcpy(slot->data, data, len);
+    slot->len = len;
+}
+
+static int
 tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
     struct tcp_hdr *hdr;
@@ -778,10 +992,11 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     char addr2[IP_ADDR_STR_LEN];
     struct ip_endpoint local, foreign;
     struct tcp_segment_info seg;
+    struct tcp_gro_slot *gro;
 
     if (len < sizeof(*hdr)) {
         errorf("too short");
-        return;
+        return -1;
     }
     hdr = (struct tcp_hdr *)data;
     pseudo.src = src;
@@ -792,12 +1007,12 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
     if (cksum16((uint16_t *)hdr, len, psum) != 0) {
         errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
-        return;
+        return -1;
     }
     if (src == IP_ADDR_BROADCAST || src == iface->broadcast || dst == IP_ADDR_BROADCAST || dst == iface->broadcast) {
         errorf("only supports unicast, src=%s, dst=%s",
             ip_addr_ntop(src, addr1, sizeof(addr1)), ip_addr_ntop(dst, addr2, sizeof(addr2)));
-        return;
+        return -1;
     }
     debugf("%s:%d => %s:%d, len=%zu (payload=%zu)",
         ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
@@ -820,10 +1035,20 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     }
     seg.wnd = ntoh16(hdr->wnd);
     seg.up = ntoh16(hdr->up);
+    /* only pure data segments without options are merged */
+    if (len > hlen && hlen == sizeof(*hdr) && (hdr->flg & 0x3f & ~TCP_FLG_PSH) == TCP_FLG_ACK) {
+        tcp_gro_receive(&seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
+        return 0;
+    }
+    gro = tcp_gro_lookup(&local, &foreign);
+    if (gro) {
+        /* the segments held for the flow must precede this one */
+        tcp_gro_flush(gro);
+    }
     mutex_lock(&mutex);
     tcp_segment_arrives(&seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
     mutex_unlock(&mutex);
-    return;
+    return 0;
 }
 
 static void
@@ -881,6 +1106,10 @@ tcp_init(void)
         return -1;
     }
     net_event_subscribe(event_handler, NULL);
+    if (net_drain_subscribe(tcp_gro_drain, NULL) == -1) {
+        errorf("net_drain_subscribe() failure");
+        return -1;
+    }
     return 0;
 }
 
@@ -906,7 +1135,7 @@ tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int acti
     pcb->mode = TCP_PCB_MODE_RFC793;
     if (!active) {
         debugf("passive open: local=%s, waiting for connection...", ip_endpoint_ntop(local, ep1, sizeof(ep1)));
-        pcb->local = *local;
+        tcp_pcb_set_local(pcb, local);
         if (foreign) {
             pcb->foreign = *foreign;
         }
@@ -914,7 +1143,7 @@ tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int acti
     } else {
         debugf("active open: local=%s, foreign=%s, connecting...",
             ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)));
-        pcb->local = *local;
+        tcp_pcb_set_local(pcb, local);
         pcb->foreign = *foreign;
         pcb->rcv.wnd = sizeof(pcb->buf);
         pcb->iss = random();
@@ -1012,7 +1241,6 @@ tcp_connect(int id, struct ip_endpoint *foreign)
     struct ip_endpoint local;
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
-    int p;
     int state;
 
     mutex_lock(&mutex);
@@ -1030,32 +1258,32 @@ tcp_connect(int id, struct ip_endpoint *foreign)
     local.addr = pcb->local.addr;
     local.port = pcb->local.port;
     if (local.addr == IP_ADDR_ANY) {
-        iface = ip_route_get_iface(foreign->addr);
+        /*
+         * the flow sticks to one of the paths of the multipath route. The ephemeral port is not
+         * known yet, so the path is picked with a random key in place of it, and the port is
+         * taken from the space of the address of that path below.
+         */
+        iface = ip_route_get_iface_flow(IP_PROTOCOL_TCP, foreign->addr, local.port ? local.port : (uint16_t)random(), foreign->port);
         if (!iface) {
-            errorf("ip_route_get_iface() failure");
+            errorf("ip_route_get_iface_flow() failure");
             mutex_unlock(&mutex);
             return -1;
         }
-        debugf("select source address: %s", ip_addr_ntop(iface->unicast, addr, sizeof(addr)));
+        debugf("select source address by flow: %s", ip_addr_ntop(iface->unicast, addr, sizeof(addr)));
         local.addr = iface->unicast;
     }
     if (!local.port) {
-        for (p = TCP_SOURCE_PORT_MIN; p <= TCP_SOURCE_PORT_MAX; p++) {
-            local.port = p;
-            if (!tcp_pcb_select(&local, foreign)) {
-                debugf("dinamic assign srouce port: %d", ntoh16(local.port));
-                pcb->local.port = local.port;
-                break;
-            }
-        }
+        /* the port may be in use towards the other foreign endpoints */
+        local.port = port_alloc(IP_PROTOCOL_TCP, local.addr, foreign, tcp_port_used);
         if (!local.port) {
             debugf("failed to dinamic assign srouce port");
             mutex_unlock(&mutex);
             return -1;
         }
+        debugf("dinamic assign srouce port: %d", ntoh16(local.port));
+        pcb->ephemeral = local;
     }
-    pcb->local.addr = local.addr;
-    pcb->local.port = local.port;
+    tcp_pcb_set_local(pcb, &local);
     pcb->foreign.addr = foreign->addr;
     pcb->foreign.port = foreign->port;
     pcb->rcv.wnd = sizeof(pcb->buf);
@@ -1102,6 +1330,7 @@ int
 tcp_bind(int id, struct ip_endpoint *local)
 {
     struct tcp_pcb *pcb, *exist;
+    char addr[IP_ADDR_STR_LEN];
     char ep[IP_ENDPOINT_STR_LEN];
 
     mutex_lock(&mutex);
@@ -1116,18 +1345,42 @@ tcp_bind(int id, struct ip_endpoint *local)
         mutex_unlock(&mutex);
         return -1;
     }
+    if (local->addr != IP_ADDR_ANY && !ip_iface_select(local->addr)) {
+        errorf("address not available, addr=%s", ip_addr_ntop(local->addr, addr, sizeof(addr)));
+        mutex_unlock(&mutex);
+        return -1;
+    }
     exist = tcp_pcb_select(local, NULL);
     if (exist) {
         errorf("already bound, exist=%s", ip_endpoint_ntop(&exist->local, ep, sizeof(ep)));
         mutex_unlock(&mutex);
         return -1;
     }
-    pcb->local = *local;
+    tcp_pcb_set_local(pcb, local);
     debugf("success: local=%s", ip_endpoint_ntop(&pcb->local, ep, sizeof(ep)));
     mutex_unlock(&mutex);
     return 0;
 }
 
+/* NOTE: the TOS is used for the segments sent after this call */
+int
+tcp_set_tos(int id, uint8_t tos)
+{
+    struct tcp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    pcb->dst.tos = tos;
+    debugf("id=%d, tos=0x%02x", id, tos);
+    mutex_unlock(&mutex);
+    return 0;
+}
+
 int
 tcp_listen(int id, int backlog)
 {
@@ -1204,9 +1457,8 @@ ssize_t
 tcp_send(int id, uint8_t *data, size_t len)
 {
     struct tcp_pcb *pcb;
-    ssize_t sent = 0;
-    struct ip_iface *iface;
-    size_t mss, cap, slen;
+    ssize_t sent = 0, ret;
+    size_t cap, slen;
 
     mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
@@ -1234,13 +1486,11 @@ RETRY:
         return -1;
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_CLOSE_WAIT:
-        iface = ip_route_get_iface(pcb->local.addr);
-        if (!iface) {
-            errorf("iface not found");
+        if (!ip_dst_cache_mtu(&pcb->dst, IP_PROTOCOL_TCP, &pcb->local, &pcb->foreign)) {
+            errorf("no route to host");
             mutex_unlock(&mutex);
             return -1;
         }
-        mss = NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
         while (sent < (ssize_t)len) {
             cap = pcb->snd.wnd - (pcb->snd.nxt - pcb->snd.una);
             if (!cap) {
@@ -1255,8 +1505,16 @@ RETRY:
                 }
                 goto RETRY;
             }
-            slen = MIN(MIN(mss, len - sent), cap);
-            if (tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_PSH, data + sent, slen) == -1) {
+            /* NOTE: the super-segment is split into MSS-sized segments at the device step (GSO) */
+            slen = MIN(MIN(TCP_SEGMENT_SIZE_MAX, len - sent), cap);
+            ret = tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_PSH, data + sent, slen);
+            if (ret == NET_DEVICE_OUTPUT_FULL) {
+                /* the segment is in the retransmission queue already and sent again from there */
+                pcb->snd.nxt += slen;
+                sent += slen;
+                break;
+            }
+            if (ret == -1) {
                 errorf("tcp_output() failure");
                 pcb->state = TCP_PCB_STATE_CLOSED;
                 tcp_pcb_release(pcb);
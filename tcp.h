@@ -42,5 +42,7 @@ extern int
 tcp_listen(int id, int backlog);
 extern int
 tcp_accept(int id, struct ip_endpoint *foreign);
+extern int
+tcp_set_tos(int id, uint8_t tos);
 
 #endif
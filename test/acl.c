@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "util.h"
+#include "ip.h"
+#include "acl.h"
+
+#include "test.h"
+
+#define TEST_RULES   200
+#define TEST_LOOKUPS 100000
+
+/* NOTE: the reference model, the rules are scanned linearly and the first matching one wins */
+struct model_rule {
+    int action;
+    int dir;
+    int protocol; /* -1: any */
+    int ports;
+    uint32_t range[4][2]; /* src, dst, sport, dport in host byte order */
+};
+
+static struct model_rule model[TEST_RULES];
+static size_t model_num;
+
+static int
+model_filter(int dir, uint8_t protocol, uint32_t src, uint32_t dst, const uint8_t *data, size_t len)
+{
+    struct model_rule *rule;
+    uint32_t values[4];
+    int ports, f;
+
+    ports = (protocol == IP_PROTOCOL_TCP || protocol == IP_PROTOCOL_UDP) && data && len >= 4;
+    values[0] = src;
+    values[1] = dst;
+    values[2] = ports ? (uint32_t)(data[0] << 8 | data[1]) : 0;
+    values[3] = ports ? (uint32_t)(data[2] << 8 | data[3]) : 0;
+    for (rule = model; rule < model + model_num; rule++) {
+        if (!(rule->dir & dir) || (rule->protocol != -1 && rule->protocol != protocol)) {
+            continue;
+        }
+        if (rule->ports && !ports) {
+            continue;
+        }
+        for (f = 0; f < (ports ? 4 : 2); f++) {
+            if (values[f] < rule->range[f][0] || values[f] > rule->range[f][1]) {
+                break;
+            }
+        }
+        if (f == (ports ? 4 : 2)) {
+            return rule->action;
+        }
+    }
+    return ACL_ACTION_ACCEPT;
+}
+
+static uint32_t
+mask(int plen)
+{
+    return plen ? 0xffffffff << (32 - plen) : 0;
+}
+
+/* NOTE: the addresses are clustered so that the prefixes of the rules overlap */
+static uint32_t
+random_addr(void)
+{
+    static const uint32_t bases[] = {0x0a000000, 0xc0a80000, 0xc0000200};
+
+    return bases[rand() % countof(bases)] | (rand() & 0xffff);
+}
+
+static uint16_t
+random_port(void)
+{
+    static const uint16_t ports[] = {0, 22, 53, 80, 443, 1023, 1024, 8080, 49152, 65535};
+
+    return rand() % 2 ? ports[rand() % countof(ports)] : rand() & 0xffff;
+}
+
+static void
+write_prefix(FILE *fp, const char *key, uint32_t range[2])
+{
+    char addr[IP_ADDR_STR_LEN];
+    int plen;
+
+    plen = (int[]){8, 16, 20, 24, 28, 32}[rand() % 6];
+    range[0] = random_addr() & mask(plen);
+    range[1] = range[0] | ~mask(plen);
+    fprintf(fp, " %s %s/%d", key, ip_addr_ntop(hton32(range[0]), addr, sizeof(addr)), plen);
+}
+
+static void
+write_ports(FILE *fp, const char *key, uint32_t range[2])
+{
+    uint16_t a, b;
+
+    a = random_port();
+    b = rand() % 2 ? a : random_port();
+    range[0] = MIN(a, b);
+    range[1] = MAX(a, b);
+    fprintf(fp, " %s %u-%u", key, range[0], range[1]);
+}
+
+static void
+write_rules(const char *path)
+{
+    static const int protocols[] = {-1, IP_PROTOCOL_ICMP, IP_PROTOCOL_TCP, IP_PROTOCOL_UDP, 50};
+    FILE *fp;
+    struct model_rule *rule;
+    int f;
+
+    fp = fopen(path, "w");
+    TEST_ASSERT(fp);
+    fprintf(fp, "# generated by %s\n\n", __FILE__);
+    for (model_num = 0; model_num < TEST_RULES; model_num++) {
+        rule = &model[model_num];
+        rule->action = rand() % 2 ? ACL_ACTION_DROP : ACL_ACTION_ACCEPT;
+        fprintf(fp, "%s", rule->action == ACL_ACTION_DROP ? "drop" : "accept");
+        rule->dir = (rand() % 3) + 1;
+        if (rule->dir != (ACL_DIR_IN | ACL_DIR_OUT)) {
+            fprintf(fp, " %s", rule->dir == ACL_DIR_IN ? "in" : "out");
+        }
+        rule->protocol = protocols[rand() % countof(protocols)];
+        if (rule->protocol != -1) {
+            fprintf(fp, " proto %d", rule->protocol);
+        }
+        for (f = 0; f < 4; f++) {
+            rule->range[f][0] = 0;
+            rule->range[f][1] = f < 2 ? UINT32_MAX : 65535;
+        }
+        if (rand() % 2) {
+            write_prefix(fp, "src", rule->range[0]);
+        }
+        if (rand() % 2) {
+            write_prefix(fp, "dst", rule->range[1]);
+        }
+        rule->ports = 0;
+        if (rule->protocol == IP_PROTOCOL_TCP || rule->protocol == IP_PROTOCOL_UDP) {
+            if (rand() % 2) {
+                write_ports(fp, "sport", rule->range[2]);
+                rule->ports = 1;
+            }
+            if (rand() % 2) {
+                write_ports(fp, "dport", rule->range[3]);
+                rule->ports = 1;
+            }
+        }
+        fprintf(fp, " # rule %zu\n", model_num + 1);
+    }
+    TEST_ASSERT(fclose(fp) == 0);
+}
+
+static void
+test_classify(const char *path)
+{
+    static const uint8_t protocols[] = {IP_PROTOCOL_ICMP, IP_PROTOCOL_TCP, IP_PROTOCOL_UDP, 50};
+    uint8_t data[4];
+    size_t i, len;
+    int dir;
+    uint8_t protocol;
+    uint32_t src, dst;
+    uint16_t sport, dport;
+
+    write_rules(path);
+    TEST_ASSERT(acl_load(path) != -1);
+    for (i = 0; i < TEST_LOOKUPS; i++) {
+        dir = rand() % 2 ? ACL_DIR_IN : ACL_DIR_OUT;
+        protocol = protocols[rand() % countof(protocols)];
+        src = random_addr();
+        dst = random_addr();
+        sport = random_port();
+        dport = random_port();
+        data[0] = sport >> 8;
+        data[1] = sport & 0xff;
+        data[2] = dport >> 8;
+        data[3] = dport & 0xff;
+        len = rand() % 8 ? sizeof(data) : 2; /* truncated header: no ports */
+        TEST_ASSERT(acl_filter(dir, protocol, hton32(src), hton32(dst), data, len) == model_filter(dir, protocol, src, dst, data, len));
+        TEST_ASSERT(acl_filter(dir, protocol, hton32(src), hton32(dst), NULL, 0) == model_filter(dir, protocol, src, dst, NULL, 0));
+    }
+}
+
+/* NOTE: a UDP datagram forwarded in two fragments, the second one has no UDP header */
+static void
+make_fragment(uint8_t *buf, uint16_t id, int first, uint16_t dport)
+{
+    struct ip_hdr *hdr;
+
+    memset(buf, 0, IP_HDR_SIZE_MIN + 8);
+    hdr = (struct ip_hdr *)buf;
+    hdr->vhl = (IP_VERSION_IPV4 << 4) | (IP_HDR_SIZE_MIN >> 2);
+    hdr->total = hton16(IP_HDR_SIZE_MIN + 8);
+    hdr->id = hton16(id);
+    hdr->offset = hton16(first ? IP_HDR_FLAG_MF : 1);
+    hdr->ttl = 64;
+    hdr->protocol = IP_PROTOCOL_UDP;
+    ip_addr_pton("198.51.100.1", &hdr->src);
+    ip_addr_pton("192.0.2.1", &hdr->dst);
+    if (first) {
+        buf[IP_HDR_SIZE_MIN + 0] = 0x30; /* sport 12345 */
+        buf[IP_HDR_SIZE_MIN + 1] = 0x39;
+        buf[IP_HDR_SIZE_MIN + 2] = dport >> 8;
+        buf[IP_HDR_SIZE_MIN + 3] = dport & 0xff;
+    }
+}
+
+static void
+test_fragments(const char *path)
+{
+    FILE *fp;
+    uint8_t buf[IP_HDR_SIZE_MIN + 8];
+    size_t len = sizeof(buf);
+
+    fp = fopen(path, "w");
+    TEST_ASSERT(fp);
+    fprintf(fp, "drop in proto udp dport 53\n");
+    TEST_ASSERT(fclose(fp) == 0);
+    TEST_ASSERT(acl_load(path) != -1);
+    /* the rest of a datagram whose first fragment was dropped */
+    make_fragment(buf, 1, 1, 53);
+    TEST_ASSERT(acl_filter_datagram(ACL_DIR_IN, buf, len) == ACL_ACTION_DROP);
+    make_fragment(buf, 1, 0, 0);
+    TEST_ASSERT(acl_filter_datagram(ACL_DIR_IN, buf, len) == ACL_ACTION_DROP);
+    /* the other datagrams */
+    make_fragment(buf, 2, 1, 80);
+    TEST_ASSERT(acl_filter_datagram(ACL_DIR_IN, buf, len) == ACL_ACTION_ACCEPT);
+    make_fragment(buf, 2, 0, 0);
+    TEST_ASSERT(acl_filter_datagram(ACL_DIR_IN, buf, len) == ACL_ACTION_ACCEPT);
+    make_fragment(buf, 3, 0, 0);
+    TEST_ASSERT(acl_filter_datagram(ACL_DIR_IN, buf, len) == ACL_ACTION_ACCEPT);
+}
+
+static void
+test_invalid(const char *path)
+{
+    FILE *fp;
+    int i;
+
+    fp = fopen(path, "w");
+    TEST_ASSERT(fp);
+    /* the line is longer than the buffer and the part that does not fit reads as another rule */
+    fprintf(fp, "accept");
+    for (i = 0; i < 249; i++) {
+        fputc(' ', fp);
+    }
+    fprintf(fp, "drop\n");
+    TEST_ASSERT(fclose(fp) == 0);
+    TEST_ASSERT(acl_load(path) == -1);
+    fp = fopen(path, "w");
+    TEST_ASSERT(fp);
+    fprintf(fp, "drop proto icmp dport 22\n");
+    TEST_ASSERT(fclose(fp) == 0);
+    TEST_ASSERT(acl_load(path) == -1);
+    fp = fopen(path, "w");
+    TEST_ASSERT(fp);
+    fprintf(fp, "drop src 10.0.0.0/33\n");
+    TEST_ASSERT(fclose(fp) == 0);
+    TEST_ASSERT(acl_load(path) == -1);
+    /* the rules loaded before are kept */
+    TEST_ASSERT(acl_stats(NULL, 0) == 1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char path[] = "/tmp/microps-acl-XXXXXX";
+    int fd;
+
+    srand(1);
+    fd = mkstemp(path);
+    TEST_ASSERT(fd != -1);
+    close(fd);
+    test_classify(path);
+    test_fragments(path);
+    test_invalid(path);
+    unlink(path);
+    printf("PASS %s\n", argv[0]);
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/types.h>
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+
+#include "test.h"
+
+/*
+ * NOTE: datagrams per second forwarded in router mode between two devices, not run by `make check`.
+ *       the datagrams are injected into the input queue of one device and counted at the transmit
+ *       of the other one, so the figure covers the whole path through the input and output queues.
+ *       the stack logs every datagram to stderr, run as `./test/bench_forward.exe 2>/dev/null`.
+ */
+
+#define BENCH_PACKETS 200000
+#define BENCH_WINDOW  128 /* datagrams in flight, less than the output queue of a class */
+#define BENCH_LEN     64
+
+static volatile unsigned long forwarded;
+
+static int
+bench_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+{
+    __atomic_add_fetch(&forwarded, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static struct net_device_ops bench_ops = {
+    .transmit = bench_transmit,
+};
+
+static struct net_device *
+bench_device(const char *unicast, const char *netmask)
+{
+    struct net_device *dev;
+    struct ip_iface *iface;
+
+    dev = net_device_alloc(NULL);
+    TEST_ASSERT(dev);
+    dev->type = NET_DEVICE_TYPE_NULL;
+    dev->mtu = 1500;
+    dev->ops = &bench_ops;
+    TEST_ASSERT(net_device_register(dev) != -1);
+    iface = ip_iface_alloc(unicast, netmask);
+    TEST_ASSERT(iface);
+    TEST_ASSERT(ip_iface_register(dev, iface) != -1);
+    return dev;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct net_device *ingress;
+    uint8_t buf[BENCH_LEN] = {};
+    struct ip_hdr *hdr;
+    unsigned long injected;
+    double start, elapsed;
+
+    TEST_ASSERT(net_init() != -1);
+    ingress = bench_device("10.0.2.1", "255.255.255.0");
+    bench_device("10.0.1.1", "255.255.255.0");
+    ip_forwarding(1);
+    TEST_ASSERT(net_run() != -1);
+    /* a UDP datagram from a host behind the ingress to a host behind the egress */
+    hdr = (struct ip_hdr *)buf;
+    hdr->vhl = (IP_VERSION_IPV4 << 4) | (IP_HDR_SIZE_MIN >> 2);
+    hdr->total = hton16(sizeof(buf));
+    hdr->ttl = 64;
+    hdr->protocol = IP_PROTOCOL_UDP;
+    ip_addr_pton("10.0.2.5", &hdr->src);
+    ip_addr_pton("10.0.1.7", &hdr->dst);
+    hdr->sum = cksum16((uint16_t *)hdr, IP_HDR_SIZE_MIN, 0);
+    start = now();
+    for (injected = 0; injected < BENCH_PACKETS; injected++) {
+        while (injected - __atomic_load_n(&forwarded, __ATOMIC_RELAXED) >= BENCH_WINDOW) {
+            sched_yield();
+        }
+        TEST_ASSERT(net_input_handler(NET_PROTOCOL_TYPE_IP, buf, sizeof(buf), ingress) != -1);
+    }
+    while (__atomic_load_n(&forwarded, __ATOMIC_RELAXED) < injected && now() - start < 60) {
+        sched_yield();
+    }
+    elapsed = now() - start;
+    net_shutdown();
+    TEST_ASSERT(forwarded == injected);
+    printf("packets=%lu, len=%d, %.1fk packets/s\n", forwarded, BENCH_LEN, forwarded / elapsed / 1e3);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+
+#include "driver/loopback.h"
+
+#include "test.h"
+
+/*
+ * NOTE: lookups per second of ip_route_get_iface() at 10, 1k and 100k routes, not run by `make check`.
+ *       the routes are random prefixes of /8 to /32 and are added on top of the previous ones.
+ *       run as `./test/bench_route.exe 2>/dev/null`, the stack logs each route added to stderr.
+ */
+
+#define BENCH_LOOKUPS (1 << 22)
+#define BENCH_ADDRS   (1 << 16) /* random destinations looked up in turn, must be a power of 2 */
+
+static const size_t sizes[] = {10, 1000, 100000};
+
+static uint32_t addrs[BENCH_ADDRS];
+
+static uint32_t
+random32(void)
+{
+    return (uint32_t)rand() << 16 ^ (uint32_t)rand();
+}
+
+static uint32_t
+mask(int plen)
+{
+    return plen ? 0xffffffff << (32 - plen) : 0;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct net_device *dev;
+    struct ip_iface *iface;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+    size_t num = 0, s, i, found;
+    uint32_t network;
+    int plen;
+    double start, elapsed;
+
+    srand(1);
+    TEST_ASSERT(net_init() != -1);
+    dev = loopback_init();
+    TEST_ASSERT(dev);
+    iface = ip_iface_alloc(LOOPBACK_IP_ADDR, LOOPBACK_NETMASK);
+    TEST_ASSERT(iface);
+    TEST_ASSERT(ip_iface_register(dev, iface) != -1);
+    for (i = 0; i < BENCH_ADDRS; i++) {
+        addrs[i] = random32();
+    }
+    for (s = 0; s < countof(sizes); s++) {
+        for (; num < sizes[s]; num++) {
+            plen = 8 + rand() % 25;
+            network = random32() & mask(plen);
+            TEST_ASSERT(ip_route_add_path(ip_addr_ntop(hton32(network), addr1, sizeof(addr1)),
+                ip_addr_ntop(hton32(mask(plen)), addr2, sizeof(addr2)), "0.0.0.0", iface, 1) != -1);
+        }
+        found = 0;
+        start = now();
+        for (i = 0; i < BENCH_LOOKUPS; i++) {
+            found += ip_route_get_iface(hton32(addrs[i & (BENCH_ADDRS - 1)])) != NULL;
+        }
+        elapsed = now() - start;
+        printf("routes=%zu, lookups=%d, found=%zu, %.1fM lookups/s\n", num, BENCH_LOOKUPS, found, BENCH_LOOKUPS / elapsed / 1e6);
+    }
+    return 0;
+}
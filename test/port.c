@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "util.h"
+#include "ip.h"
+#include "port.h"
+
+#include "test.h"
+
+#define TEST_PORT_NUM (PORT_EPHEMERAL_MAX - PORT_EPHEMERAL_MIN + 1)
+#define TEST_ADDR_NUM 1024 /* far more than the addresses of a typical host */
+#define TEST_FLOWS    64
+
+static uint8_t taken[TEST_PORT_NUM]; /* ports held by the test, indexed from PORT_EPHEMERAL_MIN */
+static struct ip_endpoint flows[TEST_FLOWS]; /* foreign address and the local port given to it */
+static size_t flow_num;
+
+static size_t
+index_of(uint16_t port)
+{
+    TEST_ASSERT(ntoh16(port) >= PORT_EPHEMERAL_MIN && ntoh16(port) <= PORT_EPHEMERAL_MAX);
+    return ntoh16(port) - PORT_EPHEMERAL_MIN;
+}
+
+static int
+none_used(ip_addr_t addr, uint16_t port, struct ip_endpoint *foreign)
+{
+    return 0;
+}
+
+/* NOTE: the ports bound explicitly by someone else, the allocator must skip them */
+static int
+even_used(ip_addr_t addr, uint16_t port, struct ip_endpoint *foreign)
+{
+    return !(ntoh16(port) % 2);
+}
+
+/* NOTE: a port is in use only towards the foreign endpoint it is connected to (as TCP) */
+static int
+flow_used(ip_addr_t addr, uint16_t port, struct ip_endpoint *foreign)
+{
+    size_t i;
+
+    for (i = 0; i < flow_num; i++) {
+        if (flows[i].addr == foreign->addr && flows[i].port == port) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+test_exhaust(void)
+{
+    ip_addr_t addr;
+    uint16_t port;
+    size_t i;
+
+    ip_addr_pton("192.0.2.1", &addr);
+    memset(taken, 0, sizeof(taken));
+    for (i = 0; i < TEST_PORT_NUM; i++) {
+        port = port_alloc(IP_PROTOCOL_UDP, addr, NULL, none_used);
+        TEST_ASSERT(port);
+        TEST_ASSERT(!taken[index_of(port)]);
+        taken[index_of(port)] = 1;
+    }
+    TEST_ASSERT(!port_alloc(IP_PROTOCOL_UDP, addr, NULL, none_used));
+    /* the space of the other protocol is independent */
+    port = port_alloc(IP_PROTOCOL_TCP, addr, NULL, none_used);
+    TEST_ASSERT(port);
+    port_release(IP_PROTOCOL_TCP, addr, port);
+    /* a released port is the only one available */
+    port = hton16(PORT_EPHEMERAL_MIN + 12345);
+    port_release(IP_PROTOCOL_UDP, addr, port);
+    TEST_ASSERT(port_alloc(IP_PROTOCOL_UDP, addr, NULL, none_used) == port);
+    for (i = 0; i < TEST_PORT_NUM; i++) {
+        port_release(IP_PROTOCOL_UDP, addr, hton16(PORT_EPHEMERAL_MIN + i));
+    }
+}
+
+static void
+test_skip_used(void)
+{
+    ip_addr_t addr;
+    uint16_t port;
+    size_t i;
+
+    ip_addr_pton("192.0.2.2", &addr);
+    for (i = 0; i < TEST_PORT_NUM / 2; i++) {
+        port = port_alloc(IP_PROTOCOL_UDP, addr, NULL, even_used);
+        TEST_ASSERT(port && ntoh16(port) % 2);
+    }
+    TEST_ASSERT(!port_alloc(IP_PROTOCOL_UDP, addr, NULL, even_used));
+    for (i = 0; i < TEST_PORT_NUM; i++) {
+        port_release(IP_PROTOCOL_UDP, addr, hton16(PORT_EPHEMERAL_MIN + i));
+    }
+}
+
+/* NOTE: the spaces are created and freed on demand, any number of addresses can be used over time */
+static void
+test_many_addrs(void)
+{
+    ip_addr_t addr;
+    uint16_t ports[TEST_ADDR_NUM];
+    size_t round, i;
+
+    for (round = 0; round < 4; round++) {
+        for (i = 0; i < TEST_ADDR_NUM; i++) {
+            addr = hton32(0x0a000000 | (round * TEST_ADDR_NUM + i));
+            ports[i] = port_alloc(IP_PROTOCOL_UDP, addr, NULL, none_used);
+            TEST_ASSERT(ports[i]);
+        }
+        for (i = 0; i < TEST_ADDR_NUM; i++) {
+            addr = hton32(0x0a000000 | (round * TEST_ADDR_NUM + i));
+            port_release(IP_PROTOCOL_UDP, addr, ports[i]);
+        }
+    }
+}
+
+/* NOTE: the space is freed after each release, the port must not start over from the same one */
+static void
+test_idle_space(void)
+{
+    ip_addr_t addr;
+    uint16_t first, port;
+    size_t i, same = 0;
+
+    ip_addr_pton("192.0.2.4", &addr);
+    first = port_alloc(IP_PROTOCOL_UDP, addr, NULL, none_used);
+    TEST_ASSERT(first);
+    port_release(IP_PROTOCOL_UDP, addr, first);
+    for (i = 0; i < 16; i++) {
+        port = port_alloc(IP_PROTOCOL_UDP, addr, NULL, none_used);
+        TEST_ASSERT(port);
+        port_release(IP_PROTOCOL_UDP, addr, port);
+        same += (port == first);
+    }
+    TEST_ASSERT(same < 16);
+}
+
+static void
+test_foreign(void)
+{
+    ip_addr_t addr;
+    struct ip_endpoint foreign;
+    uint16_t port;
+    size_t i;
+
+    ip_addr_pton("192.0.2.3", &addr);
+    ip_endpoint_pton("198.51.100.1:80", &foreign);
+    /* the same foreign endpoint never gets the same port twice */
+    for (i = 0; i < TEST_FLOWS / 2; i++) {
+        port = port_alloc(IP_PROTOCOL_TCP, addr, &foreign, flow_used);
+        TEST_ASSERT(port);
+        TEST_ASSERT(!flow_used(addr, port, &foreign));
+        flows[flow_num].addr = foreign.addr;
+        flows[flow_num].port = port;
+        flow_num++;
+    }
+    /* each of the other foreign endpoints gets a port as well, it may be one of the above */
+    for (i = 0; i < TEST_FLOWS / 2; i++) {
+        foreign.addr = hton32(ntoh32(foreign.addr) + 1);
+        port = port_alloc(IP_PROTOCOL_TCP, addr, &foreign, flow_used);
+        TEST_ASSERT(port);
+        flows[flow_num].addr = foreign.addr;
+        flows[flow_num].port = port;
+        flow_num++;
+    }
+    for (i = 0; i < flow_num; i++) {
+        port_release(IP_PROTOCOL_TCP, addr, flows[i].port);
+    }
+    flow_num = 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    TEST_ASSERT(port_init() != -1);
+    test_exhaust();
+    test_skip_used();
+    test_many_addrs();
+    test_idle_space();
+    test_foreign();
+    printf("PASS %s\n", argv[0]);
+    return 0;
+}
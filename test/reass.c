@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+
+#include "driver/loopback.h"
+
+#include "test.h"
+
+#define TEST_PROTOCOL 253 /* RFC 3692 experimentation */
+
+static volatile size_t delivered; /* length of the last datagram delivered, 0 if none */
+
+static int
+test_protocol_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+{
+    delivered = len;
+    return 0;
+}
+
+/* NOTE: the header has (hlen - IP_HDR_SIZE_MIN) bytes of NOP options */
+static void
+send_fragment(struct net_device *dev, uint16_t id, uint8_t hlen, uint16_t offset, int more, size_t len)
+{
+    static uint8_t buf[IP_TOTAL_SIZE_MAX];
+    struct ip_hdr *hdr;
+    ip_addr_t addr;
+
+    TEST_ASSERT(hlen + len <= sizeof(buf));
+    ip_addr_pton(LOOPBACK_IP_ADDR, &addr);
+    hdr = (struct ip_hdr *)buf;
+    memset(buf, 0, hlen);
+    hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
+    hdr->total = hton16(hlen + len);
+    hdr->id = hton16(id);
+    hdr->offset = hton16((more ? IP_HDR_FLAG_MF : 0) | (offset >> 3));
+    hdr->ttl = 0xff;
+    hdr->protocol = TEST_PROTOCOL;
+    hdr->src = addr;
+    hdr->dst = addr;
+    memset(buf + IP_HDR_SIZE_MIN, 0x01, hlen - IP_HDR_SIZE_MIN); /* NOP */
+    hdr->sum = cksum16((uint16_t *)hdr, hlen, 0);
+    memset(buf + hlen, 0xa5, len);
+    TEST_ASSERT(net_device_output(dev, NET_PROTOCOL_TYPE_IP, buf, hlen + len, NULL) != -1);
+}
+
+static size_t
+wait_delivered(void)
+{
+    usleep(100000);
+    return __atomic_exchange_n(&delivered, 0, __ATOMIC_RELAXED);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct net_device *dev;
+    struct ip_iface *iface;
+
+    TEST_ASSERT(net_init() != -1);
+    dev = loopback_init();
+    TEST_ASSERT(dev);
+    iface = ip_iface_alloc(LOOPBACK_IP_ADDR, LOOPBACK_NETMASK);
+    TEST_ASSERT(iface);
+    TEST_ASSERT(ip_iface_register(dev, iface) != -1);
+    TEST_ASSERT(ip_protocol_register("TEST", TEST_PROTOCOL, test_protocol_input) != -1);
+    TEST_ASSERT(net_run() != -1);
+
+    /* the largest datagram with 40 bytes of options is delivered */
+    send_fragment(dev, 1, IP_HDR_SIZE_MAX, 0, 1, 32000);
+    send_fragment(dev, 1, IP_HDR_SIZE_MIN, 32000, 0, IP_TOTAL_SIZE_MAX - IP_HDR_SIZE_MAX - 32000);
+    TEST_ASSERT(wait_delivered() == IP_TOTAL_SIZE_MAX - IP_HDR_SIZE_MAX);
+
+    /* one more byte than it: rejected when the first fragment is already there */
+    send_fragment(dev, 2, IP_HDR_SIZE_MAX, 0, 1, 32000);
+    send_fragment(dev, 2, IP_HDR_SIZE_MIN, 32000, 0, IP_TOTAL_SIZE_MAX - IP_HDR_SIZE_MAX - 32000 + 1);
+    TEST_ASSERT(wait_delivered() == 0);
+
+    /* and when the first fragment comes last */
+    send_fragment(dev, 3, IP_HDR_SIZE_MIN, 32000, 0, IP_TOTAL_SIZE_MAX - IP_HDR_SIZE_MAX - 32000 + 1);
+    send_fragment(dev, 3, IP_HDR_SIZE_MAX, 0, 1, 32000);
+    TEST_ASSERT(wait_delivered() == 0);
+
+    /* the payload limit with the minimum header is still accepted */
+    send_fragment(dev, 4, IP_HDR_SIZE_MIN, 0, 1, 32000);
+    send_fragment(dev, 4, IP_HDR_SIZE_MIN, 32000, 0, IP_PAYLOAD_SIZE_MAX - 32000);
+    TEST_ASSERT(wait_delivered() == IP_PAYLOAD_SIZE_MAX);
+
+    /* a second last fragment that ends beyond the first one: the gap is never filled */
+    send_fragment(dev, 5, IP_HDR_SIZE_MIN, 800, 0, 200);
+    send_fragment(dev, 5, IP_HDR_SIZE_MIN, 1000, 0, 200);
+    send_fragment(dev, 5, IP_HDR_SIZE_MIN, 0, 1, 800);
+    TEST_ASSERT(wait_delivered() == 0);
+
+    /* a last fragment that ends before the data already received: the datagram is truncated */
+    send_fragment(dev, 6, IP_HDR_SIZE_MIN, 0, 1, 800);
+    send_fragment(dev, 6, IP_HDR_SIZE_MIN, 800, 1, 800);
+    send_fragment(dev, 6, IP_HDR_SIZE_MIN, 800, 0, 200);
+    TEST_ASSERT(wait_delivered() == 0);
+
+    /* a fragment that extends past the end set by the last one */
+    send_fragment(dev, 7, IP_HDR_SIZE_MIN, 800, 0, 200);
+    send_fragment(dev, 7, IP_HDR_SIZE_MIN, 800, 1, 400);
+    send_fragment(dev, 7, IP_HDR_SIZE_MIN, 0, 1, 800);
+    TEST_ASSERT(wait_delivered() == 0);
+
+    /* the duplicates of the last fragment are accepted */
+    send_fragment(dev, 8, IP_HDR_SIZE_MIN, 800, 0, 200);
+    send_fragment(dev, 8, IP_HDR_SIZE_MIN, 800, 0, 200);
+    send_fragment(dev, 8, IP_HDR_SIZE_MIN, 0, 1, 800);
+    TEST_ASSERT(wait_delivered() == 1000);
+
+    net_shutdown();
+    printf("PASS %s\n", argv[0]);
+    return 0;
+}
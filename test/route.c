@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+
+#include "driver/null.h"
+#include "driver/loopback.h"
+
+#include "test.h"
+
+#define TEST_ROUTES  2000
+#define TEST_LOOKUPS 100000
+#define TEST_PREFIXES 64 /* distinct prefixes in the route file, most of the lines are duplicates */
+
+/* NOTE: the reference model, a linear scan where the first one added wins for the same prefix */
+struct model_route {
+    uint32_t network; /* host byte order */
+    int plen;
+    int iface;
+};
+
+static const char *unicasts[] = {
+    LOOPBACK_IP_ADDR,
+    "10.0.1.1",
+    "10.0.2.1",
+    "10.0.3.1",
+};
+static const char *netmasks[] = {
+    LOOPBACK_NETMASK,
+    "255.255.255.0",
+    "255.255.255.0",
+    "255.255.255.0",
+};
+static struct ip_iface *ifaces[countof(unicasts)];
+
+static struct model_route model[TEST_ROUTES * 2 + countof(unicasts)];
+static size_t model_num;
+
+static uint32_t
+mask(int plen)
+{
+    return plen ? 0xffffffff << (32 - plen) : 0;
+}
+
+static void
+model_add(uint32_t network, int plen, int iface)
+{
+    model[model_num].network = network & mask(plen);
+    model[model_num].plen = plen;
+    model[model_num].iface = iface;
+    model_num++;
+}
+
+/* NOTE: returns the index of the interface, -1 if there is no route */
+static int
+model_lookup(uint32_t addr)
+{
+    struct model_route *route, *candidate = NULL;
+
+    for (route = model; route < model + model_num; route++) {
+        if ((addr & mask(route->plen)) == route->network) {
+            if (!candidate || route->plen > candidate->plen) {
+                candidate = route;
+            }
+        }
+    }
+    return candidate ? candidate->iface : -1;
+}
+
+static int
+lookup(uint32_t addr)
+{
+    struct ip_iface *iface;
+    int idx;
+
+    iface = ip_route_get_iface(hton32(addr));
+    if (!iface) {
+        return -1;
+    }
+    for (idx = 0; idx < (int)countof(ifaces); idx++) {
+        if (ifaces[idx] == iface) {
+            return idx;
+        }
+    }
+    return -2;
+}
+
+/* NOTE: the prefixes are clustered so that the trie has long shared paths and nested prefixes */
+static uint32_t
+random_addr(void)
+{
+    static const uint32_t bases[] = {0x0a000000, 0xc0a80000, 0xac100000, 0x00000000};
+
+    return bases[rand() % countof(bases)] | (rand() & (rand() % 2 ? 0xffff : 0xffffff));
+}
+
+static int
+random_plen(void)
+{
+    static const int plens[] = {0, 1, 7, 8, 9, 15, 16, 17, 23, 24, 25, 31, 32};
+
+    return plens[rand() % countof(plens)];
+}
+
+static void
+check_lookups(void)
+{
+    size_t i;
+    uint32_t addr;
+    struct model_route *route;
+
+    for (i = 0; i < TEST_LOOKUPS; i++) {
+        addr = random_addr();
+        TEST_ASSERT(lookup(addr) == model_lookup(addr));
+    }
+    /* the boundaries of each prefix */
+    for (route = model; route < model + model_num; route++) {
+        addr = route->network;
+        TEST_ASSERT(lookup(addr) == model_lookup(addr));
+        addr = route->network | ~mask(route->plen);
+        TEST_ASSERT(lookup(addr) == model_lookup(addr));
+        addr = route->network - 1;
+        TEST_ASSERT(lookup(addr) == model_lookup(addr));
+        addr = (route->network | ~mask(route->plen)) + 1;
+        TEST_ASSERT(lookup(addr) == model_lookup(addr));
+    }
+}
+
+static void
+test_lpm(void)
+{
+    size_t i;
+    uint32_t network;
+    int plen, iface;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+    ip_addr_t n, m;
+
+    for (i = 0; i < TEST_ROUTES; i++) {
+        network = random_addr();
+        plen = random_plen();
+        iface = rand() % countof(ifaces);
+        n = hton32(network);
+        m = hton32(mask(plen));
+        TEST_ASSERT(ip_route_add_path(ip_addr_ntop(n, addr1, sizeof(addr1)), ip_addr_ntop(m, addr2, sizeof(addr2)), "0.0.0.0", ifaces[iface], 1) != -1);
+        model_add(network, plen, iface);
+    }
+    check_lookups();
+}
+
+/* NOTE: the first line wins among the lines of the same prefix, regardless of the sort while loading */
+static void
+test_load(void)
+{
+    char path[] = "/tmp/microps-route-XXXXXX";
+    int fd;
+    FILE *fp;
+    uint32_t networks[TEST_PREFIXES];
+    int plens[TEST_PREFIXES];
+    size_t i, j;
+    int iface;
+    char addr[IP_ADDR_STR_LEN];
+
+    for (i = 0; i < TEST_PREFIXES; i++) {
+        networks[i] = random_addr();
+        plens[i] = random_plen();
+    }
+    fd = mkstemp(path);
+    TEST_ASSERT(fd != -1);
+    fp = fdopen(fd, "w");
+    TEST_ASSERT(fp);
+    fprintf(fp, "# generated by %s\n", __FILE__);
+    for (i = 0; i < TEST_ROUTES; i++) {
+        j = rand() % TEST_PREFIXES;
+        iface = rand() % countof(ifaces);
+        TEST_ASSERT(fprintf(fp, "%s/%d 0.0.0.0 %s\n",
+            ip_addr_ntop(hton32(networks[j] & mask(plens[j])), addr, sizeof(addr)), plens[j], unicasts[iface]) > 0);
+        model_add(networks[j], plens[j], iface);
+    }
+    TEST_ASSERT(fclose(fp) == 0);
+    TEST_ASSERT(ip_route_load(path) != -1);
+    unlink(path);
+    check_lookups();
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct net_device *dev;
+    ip_addr_t addr, netmask;
+    size_t i;
+
+    srand(1);
+    TEST_ASSERT(net_init() != -1);
+    for (i = 0; i < countof(ifaces); i++) {
+        dev = i ? null_init() : loopback_init();
+        TEST_ASSERT(dev);
+        ifaces[i] = ip_iface_alloc(unicasts[i], netmasks[i]);
+        TEST_ASSERT(ifaces[i]);
+        TEST_ASSERT(ip_iface_register(dev, ifaces[i]) != -1);
+        /* the connected route */
+        ip_addr_pton(unicasts[i], &addr);
+        ip_addr_pton(netmasks[i], &netmask);
+        model_add(ntoh32(addr), __builtin_popcount(netmask), i);
+    }
+    test_lpm();
+    test_load();
+    printf("PASS %s\n", argv[0]);
+    return 0;
+}
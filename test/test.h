@@ -1,7 +1,9 @@
 #ifndef TEST_H
 #define TEST_H
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #define LOOPBACK_IP_ADDR "127.0.0.1"
 #define LOOPBACK_NETMASK "255.0.0.0"
@@ -13,6 +15,15 @@
 
 #define DEFAULT_GATEWAY "192.0.2.1"
 
+/* NOTE: the results go to stdout, the logs of the stack go to stderr */
+#define TEST_ASSERT(expr)                                          \
+    do {                                                           \
+        if (!(expr)) {                                             \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #expr); \
+            exit(1);                                               \
+        }                                                          \
+    } while (0)
+
 const uint8_t test_data[] = {
     0x45, 0x00, 0x00, 0x30,
     0x00, 0x80, 0x00, 0x00,
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "udp.h"
+#include "sock.h"
+
+#include "driver/loopback.h"
+
+#include "test.h"
+
+#define TEST_GROUP_MAX 64 /* UDP_REUSEPORT_MAX */
+#define TEST_FLOWS     256
+#define TEST_SOCKS     1000 /* more than a single chunk of the sock table */
+
+static void
+settle(void)
+{
+    usleep(100000);
+}
+
+/* NOTE: returns the number of the datagrams taken out of the queue */
+static int
+drain(int id)
+{
+    struct udp_msg msgs[UDP_MMSG_MAX];
+    uint8_t bufs[UDP_MMSG_MAX][16];
+    int i, n, total = 0;
+
+    for (i = 0; i < UDP_MMSG_MAX; i++) {
+        msgs[i].buf = bufs[i];
+        msgs[i].size = sizeof(bufs[i]);
+    }
+    while ((n = udp_recvmmsg(id, msgs, UDP_MMSG_MAX, UDP_MSG_DONTWAIT)) > 0) {
+        total += n;
+    }
+    return total;
+}
+
+static void
+test_reuseport(void)
+{
+    struct ip_endpoint local, other;
+    int members[TEST_GROUP_MAX], extra, client, i, n, total = 0, used = 0;
+
+    ip_endpoint_pton(LOOPBACK_IP_ADDR ":7000", &local);
+    ip_endpoint_pton(LOOPBACK_IP_ADDR ":7001", &other);
+    for (i = 0; i < TEST_GROUP_MAX; i++) {
+        members[i] = udp_open();
+        TEST_ASSERT(members[i] != -1);
+        TEST_ASSERT(udp_set_reuseport(members[i], 1) != -1);
+        TEST_ASSERT(udp_bind(members[i], &local) != -1);
+    }
+    /* the group is full: the rebind fails and the current binding is kept */
+    extra = udp_open();
+    TEST_ASSERT(extra != -1);
+    TEST_ASSERT(udp_set_reuseport(extra, 1) != -1);
+    TEST_ASSERT(udp_bind(extra, &other) != -1);
+    TEST_ASSERT(udp_bind(extra, &local) == -1);
+    client = udp_open();
+    TEST_ASSERT(client != -1);
+    TEST_ASSERT(udp_sendto(client, (uint8_t *)"x", 1, &other) == 1);
+    settle();
+    TEST_ASSERT(drain(extra) == 1);
+    udp_close(client);
+    /* each flow goes to one member, the flows are spread over the members */
+    for (i = 0; i < TEST_FLOWS; i++) {
+        client = udp_open();
+        TEST_ASSERT(client != -1);
+        TEST_ASSERT(udp_sendto(client, (uint8_t *)"x", 1, &local) == 1);
+        TEST_ASSERT(udp_sendto(client, (uint8_t *)"y", 1, &local) == 1);
+        udp_close(client);
+    }
+    settle();
+    for (i = 0; i < TEST_GROUP_MAX; i++) {
+        n = drain(members[i]);
+        TEST_ASSERT(n % 2 == 0);
+        total += n;
+        used += !!n;
+    }
+    TEST_ASSERT(total == TEST_FLOWS * 2);
+    TEST_ASSERT(used > TEST_GROUP_MAX / 2);
+    /* the group takes the PCB once a member leaves */
+    udp_close(members[0]);
+    TEST_ASSERT(udp_bind(extra, &local) != -1);
+    for (i = 1; i < TEST_GROUP_MAX; i++) {
+        udp_close(members[i]);
+    }
+    udp_close(extra);
+}
+
+static void
+test_rcvbuf(void)
+{
+    struct ip_endpoint local;
+    uint8_t data[500] = {};
+    size_t size;
+    unsigned long drops;
+    int server, client, i, queued;
+
+    ip_endpoint_pton(LOOPBACK_IP_ADDR ":7002", &local);
+    server = udp_open();
+    TEST_ASSERT(server != -1);
+    TEST_ASSERT(udp_bind(server, &local) != -1);
+    TEST_ASSERT(udp_set_rcvbuf(server, 0) != -1);
+    TEST_ASSERT(udp_get_rcvbuf(server, &size, &drops) != -1);
+    TEST_ASSERT(size == 1024 && drops == 0); /* clamped to UDP_RCVBUF_MIN */
+    client = udp_open();
+    TEST_ASSERT(client != -1);
+    for (i = 0; i < 10; i++) {
+        TEST_ASSERT(udp_sendto(client, data, sizeof(data), &local) == sizeof(data));
+    }
+    settle();
+    queued = drain(server);
+    TEST_ASSERT(udp_get_rcvbuf(server, &size, &drops) != -1);
+    TEST_ASSERT(queued >= 1 && queued < 10);
+    TEST_ASSERT(queued + drops == 10);
+    udp_close(client);
+    udp_close(server);
+}
+
+static void
+test_socks(void)
+{
+    static int socks[TEST_SOCKS];
+    struct sockaddr_in addr, from;
+    struct sock_mmsg msg;
+    uint8_t buf[16] = {};
+    uint32_t drops;
+    uint16_t small;
+    int i, len;
+
+    for (i = 0; i < TEST_SOCKS; i++) {
+        socks[i] = sock_open(AF_INET, SOCK_DGRAM, 0);
+        TEST_ASSERT(socks[i] != -1);
+    }
+    /* the last one is usable */
+    TEST_ASSERT(sockaddr_pton(LOOPBACK_IP_ADDR ":7003", (struct sockaddr *)&addr, sizeof(addr)) != -1);
+    TEST_ASSERT(sock_bind(socks[TEST_SOCKS - 1], (struct sockaddr *)&addr, sizeof(addr)) != -1);
+    len = sizeof(drops);
+    TEST_ASSERT(sock_getsockopt(socks[TEST_SOCKS - 1], SOL_SOCKET, SO_RXQ_OVFL, &drops, &len) != -1);
+    TEST_ASSERT(drops == 0 && len == sizeof(drops));
+    len = sizeof(small);
+    TEST_ASSERT(sock_getsockopt(socks[TEST_SOCKS - 1], SOL_SOCKET, SO_RCVBUF, &small, &len) == -1);
+    /* a message to itself, the flags and the address lengths are checked */
+    msg.addr = (struct sockaddr *)&addr;
+    msg.addrlen = sizeof(addr);
+    msg.buf = buf;
+    msg.n = 1;
+    TEST_ASSERT(sock_sendmmsg(socks[TEST_SOCKS - 1], &msg, 1, 0x8000) == -1);
+    TEST_ASSERT(sock_sendmmsg(socks[TEST_SOCKS - 1], &msg, 1, MSG_DONTWAIT) == 1);
+    settle();
+    msg.addr = (struct sockaddr *)&from;
+    msg.addrlen = sizeof(from) - 1;
+    msg.n = sizeof(buf);
+    TEST_ASSERT(sock_recvmmsg(socks[TEST_SOCKS - 1], &msg, 1, MSG_DONTWAIT) == -1);
+    msg.addrlen = sizeof(from) + 4;
+    TEST_ASSERT(sock_recvmmsg(socks[TEST_SOCKS - 1], &msg, 1, MSG_DONTWAIT) == 1);
+    TEST_ASSERT(msg.len == 1 && msg.addrlen == sizeof(from) && from.sin_port == addr.sin_port);
+    for (i = 0; i < TEST_SOCKS; i++) {
+        TEST_ASSERT(sock_close(socks[i]) != -1);
+    }
+    /* a closed one is not */
+    TEST_ASSERT(sock_close(socks[0]) == -1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct net_device *dev;
+    struct ip_iface *iface;
+
+    TEST_ASSERT(net_init() != -1);
+    dev = loopback_init();
+    TEST_ASSERT(dev);
+    iface = ip_iface_alloc(LOOPBACK_IP_ADDR, LOOPBACK_NETMASK);
+    TEST_ASSERT(iface);
+    TEST_ASSERT(ip_iface_register(dev, iface) != -1);
+    TEST_ASSERT(net_run() != -1);
+    test_reuseport();
+    test_rcvbuf();
+    test_socks();
+    net_shutdown();
+    printf("PASS %s\n", argv[0]);
+    return 0;
+}
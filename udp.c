@@ -10,18 +10,28 @@
 #include "util.h"
 #include "net.h"
 #include "ip.h"
+#include "port.h"
 #include "udp.h"
 
-#define UDP_PCB_SIZE 16
+#define UDP_PCB_CHUNK_SIZE 256 /* PCBs allocated at once when the pool runs out */
+#define UDP_PCB_CHUNK_MAX  256 /* up to 65536 PCBs */
+#define UDP_PCB_HASH_SIZE  4096 /* buckets of the local endpoint hash, must be a power of 2 */
+
+#define UDP_REUSEPORT_MAX 64 /* PCBs in a reuseport group */
+
+#define UDP_RCVBUF_DEFAULT (208 * 1024) /* bytes */
+#define UDP_RCVBUF_MIN     1024
+#define UDP_RCVBUF_MAX     (16 * 1024 * 1024)
+
+/* queue entries are recycled in power of 2 size classes from 128 bytes to 64KB */
+#define UDP_ENTRY_CLASS_SHIFT_MIN 7
+#define UDP_ENTRY_CLASS_NUM       10
+#define UDP_ENTRY_CACHE_BYTES     (256 * 1024) /* bytes kept in the free list of a class at most */
 
 #define UDP_PCB_STATE_FREE    0
 #define UDP_PCB_STATE_OPEN    1
 #define UDP_PCB_STATE_CLOSING 2
 
-/* see https://tools.ietf.org/html/rfc6335 */
-#define UDP_SOURCE_PORT_MIN 49152
-#define UDP_SOURCE_PORT_MAX 65535
-
 struct pseudo_hdr {
     uint32_t src;
     uint32_t dst;
@@ -39,19 +49,53 @@ struct udp_hdr {
 
 struct udp_pcb {
     int state;
+    int id;
+    unsigned long gen; /* bumped on each allocation, tells the PCB from a later one with the same id */
+    struct udp_pcb *next; /* next free PCB while FREE, next PCB in the same hash bucket while bound */
     struct ip_endpoint local;
-    struct queue_head queue; /* receive queue */
+    struct ip_endpoint foreign; /* pinned by udp_connect(), port is 0 if not connected */
+    struct ip_endpoint ephemeral; /* the local port taken from port_alloc() and its space, port is 0 if not */
+    int reuseport; /* allows the other reuseport PCBs to bind the same endpoint */
+    struct udp_reuseport_group *group; /* PCBs bound the same endpoint, NULL if alone */
+    struct udp_queue_entry *head; /* receive queue */
+    struct udp_queue_entry *tail;
+    size_t rcvbuf; /* limit of the bytes held in the receive queue */
+    size_t rcvbuf_used; /* including the entry headers */
+    unsigned long drops; /* datagrams dropped because the receive buffer was full */
     struct sched_ctx ctx;
+    struct ip_dst_cache dst; /* protected by the mutex */
+};
+
+/* NOTE: all the members are in the local endpoint hash, the first one found stands for the group */
+struct udp_reuseport_group {
+    size_t num;
+    struct udp_pcb *pcbs[UDP_REUSEPORT_MAX];
 };
 
 /* NOTE: the data follows immediately after the structure */
 struct udp_queue_entry {
+    struct udp_queue_entry *next; /* next entry in the receive queue, or in the free list of the class */
     struct ip_endpoint foreign;
     uint16_t len;
+    uint8_t class; /* UDP_ENTRY_CLASS_NUM if it is too large to be cached */
+};
+
+struct udp_entry_cache {
+    struct udp_queue_entry *free;
+    size_t bytes;
 };
 
 static mutex_t mutex = MUTEX_INITIALIZER;
-static struct udp_pcb pcbs[UDP_PCB_SIZE];
+/* NOTE: PCBs never move once allocated, the sleeping users keep pointers to them */
+static struct udp_pcb *chunks[UDP_PCB_CHUNK_MAX];
+static size_t chunk_num;
+static struct udp_pcb *free_pcbs;
+static struct udp_pcb *pcb_hash[UDP_PCB_HASH_SIZE]; /* bound PCBs keyed on the local endpoint */
+static struct udp_pcb *conn_hash[UDP_PCB_HASH_SIZE]; /* connected PCBs keyed on the 4-tuple */
+
+/* NOTE: entries are freed outside of the mutex by udp_recv_release(), lock order is mutex -> entry_mutex */
+static mutex_t entry_mutex = MUTEX_INITIALIZER;
+static struct udp_entry_cache entry_caches[UDP_ENTRY_CLASS_NUM];
 
 static void
 udp_dump(const uint8_t *data, size_t len)
@@ -70,32 +114,243 @@ udp_dump(const uint8_t *data, size_t len)
     funlockfile(stderr);
 }
 
+/*
+ * Receive Queue Entry
+ */
+
+static struct udp_queue_entry *
+udp_entry_alloc(size_t len)
+{
+    size_t size;
+    uint8_t class = 0;
+    struct udp_entry_cache *cache;
+    struct udp_queue_entry *entry;
+
+    size = sizeof(*entry) + len;
+    while (class < UDP_ENTRY_CLASS_NUM && size > (size_t)1 << (UDP_ENTRY_CLASS_SHIFT_MIN + class)) {
+        class++;
+    }
+    if (class < UDP_ENTRY_CLASS_NUM) {
+        size = (size_t)1 << (UDP_ENTRY_CLASS_SHIFT_MIN + class);
+        cache = &entry_caches[class];
+        mutex_lock(&entry_mutex);
+        entry = cache->free;
+        if (entry) {
+            cache->free = entry->next;
+            cache->bytes -= size;
+        }
+        mutex_unlock(&entry_mutex);
+        if (entry) {
+            entry->next = NULL;
+            entry->len = len;
+            return entry;
+        }
+    }
+    entry = memory_alloc(size);
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    entry->len = len;
+    entry->class = class;
+    return entry;
+}
+
+static void
+udp_entry_free(struct udp_queue_entry *entry)
+{
+    size_t size;
+    struct udp_entry_cache *cache;
+
+    if (entry->class < UDP_ENTRY_CLASS_NUM) {
+        size = (size_t)1 << (UDP_ENTRY_CLASS_SHIFT_MIN + entry->class);
+        cache = &entry_caches[entry->class];
+        mutex_lock(&entry_mutex);
+        if (cache->bytes + size <= UDP_ENTRY_CACHE_BYTES) {
+            entry->next = cache->free;
+            cache->free = entry;
+            cache->bytes += size;
+            entry = NULL;
+        }
+        mutex_unlock(&entry_mutex);
+    }
+    if (entry) {
+        memory_free(entry);
+    }
+}
+
 /*
  * UDP Protocol Control Block (PCB)
  *
  * NOTE: UDP PCB functions must be called after mutex locked
  */
 
+static uint32_t
+udp_pcb_hash(ip_addr_t addr, uint16_t port)
+{
+    uint32_t h;
+
+    h = ntoh32(addr) ^ ntoh16(port) * 0x9e3779b1;
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h & (UDP_PCB_HASH_SIZE - 1);
+}
+
+static uint32_t
+udp_pcb_hash_connected(ip_addr_t addr, uint16_t port, struct ip_endpoint *foreign)
+{
+    return udp_pcb_hash(addr ^ (foreign->addr * 0x9e3779b1), port ^ foreign->port);
+}
+
+/* NOTE: a connected PCB is kept in the 4-tuple hash instead of the local endpoint hash */
+static struct udp_pcb **
+udp_pcb_bucket(struct udp_pcb *pcb)
+{
+    if (pcb->foreign.port) {
+        return &conn_hash[udp_pcb_hash_connected(pcb->local.addr, pcb->local.port, &pcb->foreign)];
+    }
+    return &pcb_hash[udp_pcb_hash(pcb->local.addr, pcb->local.port)];
+}
+
+static void
+udp_pcb_hash_add(struct udp_pcb *pcb)
+{
+    struct udp_pcb **bucket;
+
+    bucket = udp_pcb_bucket(pcb);
+    pcb->next = *bucket;
+    *bucket = pcb;
+}
+
+static void
+udp_pcb_hash_del(struct udp_pcb *pcb)
+{
+    struct udp_pcb **p;
+
+    for (p = udp_pcb_bucket(pcb); *p; p = &(*p)->next) {
+        if (*p == pcb) {
+            *p = pcb->next;
+            pcb->next = NULL;
+            return;
+        }
+    }
+}
+
+/*
+ * NOTE: makes a group of the existing PCB if it is alone, and returns the group that pcb can join.
+ *       a group of one is valid. returns NULL if the group is full unless pcb is already a member.
+ */
+static struct udp_reuseport_group *
+udp_pcb_group_prepare(struct udp_pcb *pcb, struct udp_pcb *exist)
+{
+    struct udp_reuseport_group *group;
+
+    group = exist->group;
+    if (!group) {
+        group = memory_alloc(sizeof(*group));
+        if (!group) {
+            errorf("memory_alloc() failure");
+            return NULL;
+        }
+        group->pcbs[group->num++] = exist;
+        exist->group = group;
+    }
+    if (group->num == UDP_REUSEPORT_MAX && pcb->group != group) {
+        errorf("too many PCBs in the group");
+        return NULL;
+    }
+    return group;
+}
+
+/* NOTE: the group must be taken by udp_pcb_group_prepare(), and pcb must not be in any group */
+static void
+udp_pcb_group_join(struct udp_pcb *pcb, struct udp_reuseport_group *group)
+{
+    group->pcbs[group->num++] = pcb;
+    pcb->group = group;
+}
+
+static void
+udp_pcb_group_leave(struct udp_pcb *pcb)
+{
+    struct udp_reuseport_group *group;
+    size_t i;
+
+    group = pcb->group;
+    if (!group) {
+        return;
+    }
+    for (i = 0; i < group->num; i++) {
+        if (group->pcbs[i] == pcb) {
+            group->pcbs[i] = group->pcbs[--group->num];
+            break;
+        }
+    }
+    if (!group->num) {
+        memory_free(group);
+    }
+    pcb->group = NULL;
+}
+
+/* NOTE: the ids of the new PCBs follow the existing ones, the pool never shrinks */
+static int
+udp_pcb_grow(void)
+{
+    struct udp_pcb *chunk;
+    int i;
+
+    if (chunk_num == UDP_PCB_CHUNK_MAX) {
+        errorf("too many PCBs");
+        return -1;
+    }
+    chunk = memory_alloc(sizeof(*chunk) * UDP_PCB_CHUNK_SIZE);
+    if (!chunk) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    for (i = UDP_PCB_CHUNK_SIZE - 1; i >= 0; i--) {
+        chunk[i].id = chunk_num * UDP_PCB_CHUNK_SIZE + i;
+        chunk[i].next = free_pcbs;
+        free_pcbs = &chunk[i];
+    }
+    chunks[chunk_num++] = chunk;
+    debugf("grown, num=%zu", chunk_num * UDP_PCB_CHUNK_SIZE);
+    return 0;
+}
+
 static struct udp_pcb *
 udp_pcb_alloc(void)
 {
     struct udp_pcb *pcb;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == UDP_PCB_STATE_FREE) {
-            pcb->state = UDP_PCB_STATE_OPEN;
-            sched_ctx_init(&pcb->ctx);
-            return pcb;
-        }
+    if (!free_pcbs && udp_pcb_grow() == -1) {
+        return NULL;
     }
-    return NULL;
+    pcb = free_pcbs;
+    free_pcbs = pcb->next;
+    pcb->next = NULL;
+    pcb->state = UDP_PCB_STATE_OPEN;
+    pcb->gen++;
+    pcb->rcvbuf = UDP_RCVBUF_DEFAULT;
+    sched_ctx_init(&pcb->ctx);
+    return pcb;
 }
 
 static void
 udp_pcb_release(struct udp_pcb *pcb)
 {
-    struct queue_entry *entry;
+    struct udp_queue_entry *entry;
 
+    if (pcb->state == UDP_PCB_STATE_OPEN && pcb->local.port) {
+        /* the port is available again even if the users have not woken up yet */
+        udp_pcb_hash_del(pcb);
+        udp_pcb_group_leave(pcb);
+        if (pcb->ephemeral.port) {
+            port_release(IP_PROTOCOL_UDP, pcb->ephemeral.addr, pcb->ephemeral.port);
+            pcb->ephemeral.port = 0;
+        }
+    }
     pcb->state = UDP_PCB_STATE_CLOSING;
     if (sched_ctx_destroy(&pcb->ctx) == -1) {
         sched_wakeup(&pcb->ctx);
@@ -104,36 +359,79 @@ udp_pcb_release(struct udp_pcb *pcb)
     pcb->state = UDP_PCB_STATE_FREE;
     pcb->local.addr = IP_ADDR_ANY;
     pcb->local.port = 0;
-    while ((entry = queue_pop(&pcb->queue)) != NULL) {
-        memory_free(entry);
+    pcb->foreign.addr = IP_ADDR_ANY;
+    pcb->foreign.port = 0;
+    pcb->reuseport = 0;
+    memset(&pcb->dst, 0, sizeof(pcb->dst));
+    while ((entry = pcb->head) != NULL) {
+        pcb->head = entry->next;
+        udp_entry_free(entry);
     }
+    pcb->tail = NULL;
+    pcb->rcvbuf_used = 0;
+    pcb->drops = 0;
+    pcb->next = free_pcbs;
+    free_pcbs = pcb;
 }
 
+/* NOTE: the PCB bound to the address is preferred to the one bound to the wildcard address */
 static struct udp_pcb *
 udp_pcb_select(ip_addr_t addr, uint16_t port)
 {
     struct udp_pcb *pcb;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == UDP_PCB_STATE_OPEN) {
-            if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == addr) && pcb->local.port == port) {
+    if (addr != IP_ADDR_ANY) {
+        for (pcb = pcb_hash[udp_pcb_hash(addr, port)]; pcb; pcb = pcb->next) {
+            if (pcb->local.addr == addr && pcb->local.port == port) {
                 return pcb;
             }
         }
     }
+    for (pcb = pcb_hash[udp_pcb_hash(IP_ADDR_ANY, port)]; pcb; pcb = pcb->next) {
+        if (pcb->local.addr == IP_ADDR_ANY && pcb->local.port == port) {
+            return pcb;
+        }
+    }
     return NULL;
 }
 
+static struct udp_pcb *
+udp_pcb_select_connected(ip_addr_t addr, uint16_t port, struct ip_endpoint *foreign)
+{
+    struct udp_pcb *pcb;
+
+    for (pcb = conn_hash[udp_pcb_hash_connected(addr, port, foreign)]; pcb; pcb = pcb->next) {
+        if (pcb->local.addr == addr && pcb->local.port == port &&
+            pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port) {
+            return pcb;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * NOTE: called back by port_alloc() with mutex locked. a port of the connected PCBs is
+ *       shared among the foreign endpoints, but not with the PCBs that are not connected.
+ */
+static int
+udp_port_used(ip_addr_t addr, uint16_t port, struct ip_endpoint *foreign)
+{
+    if (foreign && udp_pcb_select_connected(addr, port, foreign)) {
+        return 1;
+    }
+    return udp_pcb_select(addr, port) != NULL;
+}
+
 static struct udp_pcb *
 udp_pcb_get(int id)
 {
     struct udp_pcb *pcb;
 
-    if (id < 0 || id >= (int)countof(pcbs)) {
+    if (id < 0 || id >= (int)(chunk_num * UDP_PCB_CHUNK_SIZE)) {
         /* out of range */
         return NULL;
     }
-    pcb = &pcbs[id];
+    pcb = &chunks[id / UDP_PCB_CHUNK_SIZE][id % UDP_PCB_CHUNK_SIZE];
     if (pcb->state != UDP_PCB_STATE_OPEN) {
         return NULL;
     }
@@ -143,28 +441,30 @@ udp_pcb_get(int id)
 static int
 udp_pcb_id(struct udp_pcb *pcb)
 {
-    return indexof(pcbs, pcb);
+    return pcb->id;
 }
 
-static void
+static int
 udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
     struct pseudo_hdr pseudo;
     uint16_t psum = 0;
+    uint32_t hash;
     struct udp_hdr *hdr;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     struct udp_pcb *pcb;
+    struct ip_endpoint foreign;
     struct udp_queue_entry *entry;
 
     if (len < sizeof(*hdr)) {
         errorf("too short");
-        return;
+        return -1;
     }
     hdr = (struct udp_hdr *)data;
     if (len != ntoh16(hdr->len)) { /* just to make sure */
         errorf("length error: len=%zu, hdr->len=%u", len, ntoh16(hdr->len));
-        return;
+        return -1;
     }
     pseudo.src = src;
     pseudo.dst = dst;
@@ -174,7 +474,7 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
     if (cksum16((uint16_t *)hdr, len, psum) != 0) {
         errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
-        return;
+        return -1;
     }
     debugf("%s:%d => %s:%d, len=%zu (payload=%zu)",
         ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
@@ -182,33 +482,57 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         len, len - sizeof(*hdr));
     udp_dump(data, len);
     mutex_lock(&mutex);
-    pcb = udp_pcb_select(dst, hdr->dst);
+    foreign.addr = src;
+    foreign.port = hdr->src;
+    /* the connected PCB takes precedence over the one bound to the port */
+    pcb = udp_pcb_select_connected(dst, hdr->dst, &foreign);
+    if (!pcb) {
+        pcb = udp_pcb_select(dst, hdr->dst);
+        if (pcb && pcb->group) {
+            /*
+             * the datagrams of a flow always go to the same member. the full 32-bit hash of the flow
+             * (as the sender of the reply) is reduced by multiply-shift, which has no bias towards the lower members.
+             */
+            hash = ip_route_flow_hash(IP_PROTOCOL_UDP, src, hdr->dst, hdr->src);
+            pcb = pcb->group->pcbs[((uint64_t)hash * pcb->group->num) >> 32];
+        }
+    }
     if (!pcb) {
         /* port is not in use */
         mutex_unlock(&mutex);
-        return;
+        return IP_PROTOCOL_PORT_UNREACH;
+    }
+    /* a datagram is always accepted into the empty queue, even if it is larger than the buffer */
+    if (pcb->rcvbuf_used && pcb->rcvbuf_used + sizeof(*entry) + (len - sizeof(*hdr)) > pcb->rcvbuf) {
+        pcb->drops++;
+        debugf("receive buffer full, id=%d, used=%zu, rcvbuf=%zu", udp_pcb_id(pcb), pcb->rcvbuf_used, pcb->rcvbuf);
+        mutex_unlock(&mutex);
+        return -1;
     }
-    entry = memory_alloc(sizeof(*entry) + (len - sizeof(*hdr)));
+    entry = udp_entry_alloc(len - sizeof(*hdr));
     if (!entry) {
         mutex_unlock(&mutex);
-        errorf("memory_alloc() failure");
-        return;
+        errorf("udp_entry_alloc() failure");
+        return -1;
     }
     entry->foreign.addr = src;
     entry->foreign.port = hdr->src;
-    entry->len = len - sizeof(*hdr);
     memcpy(entry + 1, hdr + 1, entry->len);
-    if (!queue_push(&pcb->queue, entry)) {
-        mutex_unlock(&mutex);
-        errorf("queue_push() failure");
-        return;
+    if (pcb->tail) {
+        pcb->tail->next = entry;
+    } else {
+        pcb->head = entry;
     }
+    pcb->tail = entry;
+    pcb->rcvbuf_used += sizeof(*entry) + entry->len;
     sched_wakeup(&pcb->ctx);
     mutex_unlock(&mutex);
+    return 0;
 }
 
-ssize_t
-udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
+/* NOTE: the destination cache is optional */
+static ssize_t
+udp_output_cached(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len, struct ip_dst_cache *cache)
 {
     uint8_t buf[IP_PAYLOAD_SIZE_MAX];
     struct udp_hdr *hdr;
@@ -238,20 +562,35 @@ udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *dat
     debugf("%s => %s, len=%zu (payload=%zu)",
         ip_endpoint_ntop(src, ep1, sizeof(ep1)), ip_endpoint_ntop(dst, ep2, sizeof(ep2)), total, len);
     udp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr) == -1) {
+    if (cache) {
+        if (ip_output_cached(cache, IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr, NULL) < 0) {
+            errorf("ip_output_cached() failure");
+            return -1;
+        }
+        return len;
+    }
+    if (ip_output(IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr) < 0) {
         errorf("ip_output() failure");
         return -1;
     }
     return len;
 }
 
+ssize_t
+udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
+{
+    return udp_output_cached(src, dst, data, len, NULL);
+}
+
 static void
 event_handler(void *arg)
 {
     struct udp_pcb *pcb;
+    size_t i;
 
     mutex_lock(&mutex);
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
+    for (i = 0; i < chunk_num * UDP_PCB_CHUNK_SIZE; i++) {
+        pcb = &chunks[i / UDP_PCB_CHUNK_SIZE][i % UDP_PCB_CHUNK_SIZE];
         if (pcb->state == UDP_PCB_STATE_OPEN) {
             sched_interrupt(&pcb->ctx);
         }
@@ -313,6 +652,8 @@ int
 udp_bind(int id, struct ip_endpoint *local)
 {
     struct udp_pcb *pcb, *exist;
+    struct udp_reuseport_group *group = NULL;
+    char addr[IP_ADDR_STR_LEN];
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
@@ -323,28 +664,219 @@ udp_bind(int id, struct ip_endpoint *local)
         mutex_unlock(&mutex);
         return -1;
     }
+    if (pcb->foreign.port) {
+        errorf("already connected, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    if (local->addr != IP_ADDR_ANY && !ip_iface_select(local->addr)) {
+        errorf("address not available, addr=%s", ip_addr_ntop(local->addr, addr, sizeof(addr)));
+        mutex_unlock(&mutex);
+        return -1;
+    }
     exist = udp_pcb_select(local->addr, local->port);
-    if (exist) {
+    if (exist && (exist == pcb || !(pcb->reuseport && exist->reuseport && exist->local.addr == local->addr))) {
         errorf("already in use, id=%d, want=%s, exist=%s",
             id, ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(&exist->local, ep2, sizeof(ep2)));
         mutex_unlock(&mutex);
         return -1;
     }
+    /* the current binding is kept if the PCB cannot join the group */
+    if (exist) {
+        group = udp_pcb_group_prepare(pcb, exist);
+        if (!group) {
+            errorf("unable to join the group, id=%d, want=%s", id, ip_endpoint_ntop(local, ep1, sizeof(ep1)));
+            mutex_unlock(&mutex);
+            return -1;
+        }
+    }
+    if (pcb->local.port) {
+        udp_pcb_hash_del(pcb);
+        udp_pcb_group_leave(pcb);
+        if (pcb->ephemeral.port) {
+            port_release(IP_PROTOCOL_UDP, pcb->ephemeral.addr, pcb->ephemeral.port);
+            pcb->ephemeral.port = 0;
+        }
+    }
+    if (group) {
+        udp_pcb_group_join(pcb, group);
+    }
     pcb->local = *local;
+    if (pcb->local.port) {
+        udp_pcb_hash_add(pcb);
+    }
     debugf("bound, id=%d, local=%s", id, ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)));
     mutex_unlock(&mutex);
     return 0;
 }
 
-ssize_t
-udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
+/*
+ * NOTE: pins the foreign endpoint, the PCB then receives only from it (in preference to the
+ *       PCBs bound to the same port) and the route to it is kept in the destination cache.
+ *       the local address is fixed here and the port is shared with the other connected PCBs.
+ */
+int
+udp_connect(int id, struct ip_endpoint *foreign)
 {
     struct udp_pcb *pcb;
     struct ip_endpoint local;
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
-    uint32_t p;
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+
+    if (foreign->addr == IP_ADDR_ANY || !foreign->port) {
+        errorf("invalid foreign endpoint");
+        return -1;
+    }
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    local = pcb->local;
+    if (local.addr == IP_ADDR_ANY) {
+        iface = ip_route_get_iface(foreign->addr);
+        if (!iface) {
+            errorf("iface not found that can reach foreign address, addr=%s",
+                ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
+            mutex_unlock(&mutex);
+            return -1;
+        }
+        local.addr = iface->unicast;
+    }
+    if (pcb->local.port) {
+        if (udp_pcb_select_connected(local.addr, local.port, foreign)) {
+            errorf("already in use, id=%d, local=%s, foreign=%s",
+                id, ip_endpoint_ntop(&local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)));
+            mutex_unlock(&mutex);
+            return -1;
+        }
+        udp_pcb_hash_del(pcb);
+        udp_pcb_group_leave(pcb);
+    } else {
+        local.port = port_alloc(IP_PROTOCOL_UDP, local.addr, foreign, udp_port_used);
+        if (!local.port) {
+            debugf("failed to dinamic assign local port, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
+            mutex_unlock(&mutex);
+            return -1;
+        }
+        pcb->ephemeral = local;
+    }
+    pcb->local = local;
+    pcb->foreign = *foreign;
+    udp_pcb_hash_add(pcb);
+    /* the neighbor is resolved by the first datagram and kept in the cache with the route */
+    if (!ip_dst_cache_mtu(&pcb->dst, IP_PROTOCOL_UDP, &pcb->local, &pcb->foreign)) {
+        debugf("no route yet, foreign=%s", ip_endpoint_ntop(foreign, ep2, sizeof(ep2)));
+    }
+    debugf("connected, id=%d, local=%s, foreign=%s",
+        id, ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+int
+udp_set_tos(int id, uint8_t tos)
+{
+    struct udp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    pcb->dst.tos = tos;
+    debugf("id=%d, tos=0x%02x", id, tos);
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+/* NOTE: takes effect on the next udp_bind() */
+int
+udp_set_reuseport(int id, int enable)
+{
+    struct udp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    pcb->reuseport = enable ? 1 : 0;
+    debugf("id=%d, reuseport=%d", id, pcb->reuseport);
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+/* NOTE: the datagrams already queued are kept even if they exceed the new limit */
+int
+udp_set_rcvbuf(int id, size_t size)
+{
+    struct udp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    pcb->rcvbuf = MIN(MAX(size, UDP_RCVBUF_MIN), UDP_RCVBUF_MAX);
+    debugf("id=%d, rcvbuf=%zu", id, pcb->rcvbuf);
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+int
+udp_get_rcvbuf(int id, size_t *size, unsigned long *drops)
+{
+    struct udp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    if (size) {
+        *size = pcb->rcvbuf;
+    }
+    if (drops) {
+        *drops = pcb->drops;
+    }
+    mutex_unlock(&mutex);
+    return 0;
+}
 
+/*
+ * NOTE: the local address and the route are resolved once for the consecutive messages to the same
+ *       foreign endpoint, and the destination cache of the PCB is used for all the messages.
+ * NOTE: the messages without the foreign address are sent to the endpoint of the connected PCB.
+ * NOTE: the sending never waits (a full device queue fails with EAGAIN), so UDP_MSG_DONTWAIT changes nothing.
+ */
+int
+udp_sendmmsg(int id, struct udp_msg *msgs, size_t num, int flags)
+{
+    struct udp_pcb *pcb;
+    struct ip_endpoint local, connected, *foreign, *prev = NULL;
+    struct ip_iface *iface;
+    char addr[IP_ADDR_STR_LEN];
+    struct ip_dst_cache cache;
+    unsigned long gen;
+    ip_addr_t bound;
+    size_t i;
+
+    if (!num) {
+        return 0;
+    }
     mutex_lock(&mutex);
     pcb = udp_pcb_get(id);
     if (!pcb) {
@@ -352,6 +884,13 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
         mutex_unlock(&mutex);
         return -1;
     }
+    connected = pcb->foreign;
+    foreign = (msgs[0].foreign.addr != IP_ADDR_ANY) ? &msgs[0].foreign : &connected;
+    if (!foreign->port) {
+        errorf("not connected, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
     local.addr = pcb->local.addr;
     if (local.addr == IP_ADDR_ANY) {
         iface = ip_route_get_iface(foreign->addr);
@@ -365,30 +904,94 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
         debugf("select local address, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
     }
     if (!pcb->local.port) {
-        for (p = UDP_SOURCE_PORT_MIN; p <= UDP_SOURCE_PORT_MAX; p++) {
-            if (!udp_pcb_select(local.addr, hton16(p))) {
-                pcb->local.port = hton16(p);
-                debugf("dinamic assign local port, port=%d", p);
-                break;
-            }
-        }
+        pcb->local.port = port_alloc(IP_PROTOCOL_UDP, local.addr, NULL, udp_port_used);
         if (!pcb->local.port) {
             debugf("failed to dinamic assign local port, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
             mutex_unlock(&mutex);
             return -1;
         }
+        debugf("dinamic assign local port, port=%u", ntoh16(pcb->local.port));
+        pcb->ephemeral.addr = local.addr;
+        pcb->ephemeral.port = pcb->local.port;
+        udp_pcb_hash_add(pcb);
     }
+    bound = pcb->local.addr;
     local.port = pcb->local.port;
+    /* NOTE: the cache is used out of the mutex, so it is copied and written back */
+    cache = pcb->dst;
+    gen = pcb->gen;
     mutex_unlock(&mutex);
-    return udp_output(&local, foreign, data, len);
+    for (i = 0; i < num; i++) {
+        foreign = (msgs[i].foreign.addr != IP_ADDR_ANY) ? &msgs[i].foreign : &connected;
+        if (!foreign->port) {
+            errorf("not connected, id=%d", id);
+            break;
+        }
+        if (bound == IP_ADDR_ANY && (!prev || prev->addr != foreign->addr || prev->port != foreign->port)) {
+            /* the flow sticks to one of the paths of the multipath route */
+            iface = ip_route_get_iface_flow(IP_PROTOCOL_UDP, foreign->addr, local.port, foreign->port);
+            if (!iface) {
+                errorf("iface not found that can reach foreign address, addr=%s",
+                    ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
+                break;
+            }
+            local.addr = iface->unicast;
+        }
+        prev = foreign;
+        if (udp_output_cached(&local, foreign, msgs[i].buf, msgs[i].len, &cache) == -1) {
+            break;
+        }
+    }
+    mutex_lock(&mutex);
+    /* the socket may have been closed and its PCB reused by another udp_open() while sending */
+    if (pcb->state == UDP_PCB_STATE_OPEN && pcb->gen == gen) {
+        cache.tos = pcb->dst.tos; /* may be changed while sending */
+        pcb->dst = cache;
+    }
+    mutex_unlock(&mutex);
+    return i ? (int)i : -1;
 }
 
 ssize_t
-udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
+udp_send(int id, uint8_t *data, size_t len)
+{
+    struct udp_msg msg;
+
+    msg.foreign.addr = IP_ADDR_ANY;
+    msg.foreign.port = 0;
+    msg.buf = data;
+    msg.size = len;
+    msg.len = len;
+    if (udp_sendmmsg(id, &msg, 1, 0) == -1) {
+        return -1;
+    }
+    return len;
+}
+
+ssize_t
+udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
+{
+    struct udp_msg msg;
+
+    msg.foreign = *foreign;
+    msg.buf = data;
+    msg.size = len;
+    msg.len = len;
+    if (udp_sendmmsg(id, &msg, 1, 0) == -1) {
+        return -1;
+    }
+    return len;
+}
+
+/*
+ * NOTE: waits for the first datagram unless UDP_MSG_DONTWAIT, then takes the ones already queued
+ *       (up to num) in the same lock acquisition. the entries are owned by the caller on return.
+ */
+static int
+udp_receive(int id, struct udp_queue_entry **entries, size_t num, int flags)
 {
     struct udp_pcb *pcb;
-    struct udp_queue_entry *entry;
-    ssize_t len;
+    size_t n;
 
     mutex_lock(&mutex);
     pcb = udp_pcb_get(id);
@@ -397,7 +1000,12 @@ udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
         mutex_unlock(&mutex);
         return -1;
     }
-    while (!(entry = queue_pop(&pcb->queue))) {
+    while (!pcb->head) {
+        if (flags & UDP_MSG_DONTWAIT) {
+            mutex_unlock(&mutex);
+            errno = EAGAIN;
+            return -1;
+        }
         if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
             debugf("interrupted");
             mutex_unlock(&mutex);
@@ -411,12 +1019,87 @@ udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
             return -1;
         }
     }
+    for (n = 0; n < num && pcb->head; n++) {
+        entries[n] = pcb->head;
+        pcb->head = entries[n]->next;
+        entries[n]->next = NULL;
+        pcb->rcvbuf_used -= sizeof(*entries[n]) + entries[n]->len;
+    }
+    if (!pcb->head) {
+        pcb->tail = NULL;
+    }
     mutex_unlock(&mutex);
+    return n;
+}
+
+/* NOTE: the data are copied out of the mutex */
+int
+udp_recvmmsg(int id, struct udp_msg *msgs, size_t num, int flags)
+{
+    struct udp_queue_entry *entries[UDP_MMSG_MAX];
+    int n, i;
+
+    num = MIN(num, UDP_MMSG_MAX);
+    if (!num) {
+        return 0;
+    }
+    n = udp_receive(id, entries, num, flags);
+    if (n == -1) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        msgs[i].foreign = entries[i]->foreign;
+        msgs[i].len = MIN(msgs[i].size, entries[i]->len); /* truncate */
+        memcpy(msgs[i].buf, entries[i] + 1, msgs[i].len);
+        udp_entry_free(entries[i]);
+    }
+    return n;
+}
+
+/*
+ * NOTE: the datagram is handed over as it is queued, without copying it into the user buffer.
+ *       it is no longer charged to the receive buffer, and must be given back by udp_recv_release().
+ */
+ssize_t
+udp_recv_zc(int id, struct udp_zc_buf *zc, int flags)
+{
+    struct udp_queue_entry *entry;
+
+    if (udp_receive(id, &entry, 1, flags) == -1) {
+        return -1;
+    }
+    zc->data = (const uint8_t *)(entry + 1);
+    zc->len = entry->len;
+    zc->foreign = entry->foreign;
+    zc->entry = entry;
+    return zc->len;
+}
+
+/* NOTE: can be called after the socket is closed */
+void
+udp_recv_release(struct udp_zc_buf *zc)
+{
+    if (!zc->entry) {
+        return;
+    }
+    udp_entry_free(zc->entry);
+    zc->data = NULL;
+    zc->len = 0;
+    zc->entry = NULL;
+}
+
+ssize_t
+udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
+{
+    struct udp_msg msg;
+
+    msg.buf = buf;
+    msg.size = size;
+    if (udp_recvmmsg(id, &msg, 1, 0) == -1) {
+        return -1;
+    }
     if (foreign) {
-        *foreign = entry->foreign;
+        *foreign = msg.foreign;
     }
-    len = MIN(size, entry->len); /* truncate */
-    memcpy(buf, entry + 1, len);
-    memory_free(entry);
-    return len;
+    return msg.len;
 }
@@ -6,6 +6,25 @@
 
 #include "ip.h"
 
+#define UDP_MMSG_MAX 64 /* messages taken by a udp_recvmmsg() call at most */
+
+#define UDP_MSG_DONTWAIT 0x01
+
+struct udp_msg {
+    struct ip_endpoint foreign;
+    uint8_t *buf;
+    size_t size; /* size of buf */
+    size_t len; /* length of the data to send, or received */
+};
+
+/* NOTE: a read-only view of the datagram loaned by udp_recv_zc() */
+struct udp_zc_buf {
+    const uint8_t *data;
+    size_t len;
+    struct ip_endpoint foreign;
+    void *entry; /* opaque, given back by udp_recv_release() */
+};
+
 extern ssize_t
 udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *buf, size_t len);
 
@@ -16,11 +35,31 @@ extern int
 udp_open(void);
 extern int
 udp_bind(int index, struct ip_endpoint *local);
+extern int
+udp_connect(int id, struct ip_endpoint *foreign);
+extern ssize_t
+udp_send(int id, uint8_t *buf, size_t len);
 extern ssize_t
 udp_sendto(int id, uint8_t *buf, size_t len, struct ip_endpoint *foreign);
 extern ssize_t
 udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign);
 extern int
+udp_sendmmsg(int id, struct udp_msg *msgs, size_t num, int flags);
+extern int
+udp_recvmmsg(int id, struct udp_msg *msgs, size_t num, int flags);
+extern ssize_t
+udp_recv_zc(int id, struct udp_zc_buf *zc, int flags);
+extern void
+udp_recv_release(struct udp_zc_buf *zc);
+extern int
 udp_close(int id);
+extern int
+udp_set_tos(int id, uint8_t tos);
+extern int
+udp_set_reuseport(int id, int enable);
+extern int
+udp_set_rcvbuf(int id, size_t size);
+extern int
+udp_get_rcvbuf(int id, size_t *size, unsigned long *drops);
 
 #endif